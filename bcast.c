@@ -34,6 +34,10 @@ struct if_bcast {
     int fd;
     struct sockaddr_in addr;        /* Outbound address */
     struct sockaddr_in laddr;       /* local (bind) address */
+    size_t rxbatch;
+    int rxwait;
+    long pack;
+    int maxhold;
 };
 
 /* Prevention of re-reading what has been written by a bi-directional interface
@@ -106,102 +110,134 @@ void cleanup_bcast(iface_t *ifa)
 void write_bcast(struct iface *ifa)
 {
     struct if_bcast *ifb;
-    senblk_t *sptr;
-    int data=0;
-    struct msghdr msgh;
-    struct iovec iov[2];
+    senblk_t *vec[BATCHMAX];
+    struct msghdr msgs[BATCHMAX];
+    struct iovec iov[BATCHIOV];
+    size_t n,i;
+    int stride;
+    char *tbuf=NULL;
 
     ifb = (struct if_bcast *) ifa->info;
 
-    msgh.msg_name=(void *)&ifb->addr;
-    msgh.msg_namelen=sizeof(struct sockaddr_in);
-    msgh.msg_control=NULL;
-    msgh.msg_controllen=msgh.msg_flags=0;
-    msgh.msg_iov=iov;
-    msgh.msg_iovlen=1;
+    if (ifb->pack) {
+        write_packed(ifa,ifb->fd,&ifb->addr,sizeof(struct sockaddr_in),ifb->pack,ifb->maxhold);
+        iface_thread_exit(errno);
+    }
+
+    memset(msgs,0,sizeof(msgs));
+    for (i=0;i<BATCHMAX;i++) {
+        msgs[i].msg_name=(void *)&ifb->addr;
+        msgs[i].msg_namelen=sizeof(struct sockaddr_in);
+    }
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*BATCHMAX)) == NULL) {
                 logerr(errno,"Disabing tag output on interface id %u (%s)",
                         ifa->id,(ifa->name)?ifa->name:"unlabelled");
                 ifa->tagflags=0;
-        } else {
-            msgh.msg_iovlen=2;
-            data=1;
         }
     }
 
     for (;;) {
-        if ((sptr = next_senblk(ifa->q)) == NULL)
+        if ((n = next_senblk_batch(ifa->q,vec,BATCHMAX)) == 0)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
+        stride=senblk_iov(ifa,vec,&n,iov,tbuf,0);
+        for (i=0;i<n;i++) {
+            msgs[i].msg_iov=iov+i*stride;
+            msgs[i].msg_iovlen=stride;
         }
 
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %u (%s)",
-                        ifa->id,(ifa->name)?ifa->name:"unlabelled");
-                ifa->tagflags=0;
-                msgh.msg_iovlen=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
-
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
-
-        if ((sendmsg(ifb->fd,&msgh,0)) < 0)
+        if (n && send_batch(ifb->fd,msgs,n) < 0) {
+            senblk_free_batch(vec,n,ifa->q);
             break;
-
-        senblk_free(sptr,ifa->q);
+        }
+        senblk_free_batch(vec,n,ifa->q);
     }
 
-    if (ifa->tagflags)
-        free(iov[0].iov_base);
+    if (tbuf)
+        free(tbuf);
 
     iface_thread_exit(errno);
 }
 
+/*
+ * Compare a datagram's source address to the list of interfaces we're ignoring
+ * Args: Source address and its length
+ * Returns: 1 if the datagram should be dropped, 0 otherwise
+ */
+static int bcast_ignored(struct sockaddr_in *src, socklen_t sz)
+{
+    struct ignore_addr *igp;
+
+    /* Probably superfluous check that we got the right size
+     * structure back */
+    if (sz != (socklen_t) sizeof(*src))
+        return(1);
+#if 0
+    pthread_rwlock_rdlock(&sysaddr_lock);
+#endif
+    for (igp=ignore;igp;igp=igp->next) {
+        if (igp->iaddr.sin_addr.s_addr == src->sin_addr.s_addr)
+            break;
+    }
+#if 0
+    pthread_rwlock_unlock(&sysaddr_lock);
+#endif
+    /* If igp points to anything, we broke out of the above loop
+     * on a match. */
+    return(igp != NULL);
+}
+
 ssize_t read_bcast(struct iface *ifa, char *buf)
 {
     struct if_bcast *ifb=(struct if_bcast *) ifa->info;
     struct sockaddr_in src;
-    struct ignore_addr *igp;
-    socklen_t sz = (socklen_t) sizeof(src);
+    socklen_t sz;
     ssize_t nread;
 
 
     do {
+        sz = (socklen_t) sizeof(src);
         nread = recvfrom(ifb->fd,buf,BUFSIZ,0,(struct sockaddr *) &src,&sz);
-        /* Probably superfluous check that we got the right size
-         * structure back */
-        if (sz != (socklen_t) sizeof(src)) {
-            sz = (socklen_t) sizeof(src);
-            continue;
-        }
-        /* Compare the source address to the list of interfaces we're
-         * ignoring */
-#if 0
-        pthread_rwlock_rdlock(&sysaddr_lock);
-#endif
-        for (igp=ignore;igp;igp=igp->next) {
-            if (igp->iaddr.sin_addr.s_addr == src.sin_addr.s_addr)
-                break;
-        }
-#if 0
-        pthread_rwlock_unlock(&sysaddr_lock);
-#endif
-        /* If igp points to anything, we broke out of the above loop
-         * on a match. Drop the packet and carry on */
-        if (igp == NULL)
-            break;
-    } while (1);
+        /* Drop the packet and carry on if it's one of ours */
+    } while (nread >= 0 && bcast_ignored(&src,sz));
     return nread;
 }
 
+/*
+ * Read routine for broadcast interfaces, receiving several datagrams per call
+ * Args: Interface Pointer
+ * Returns: nothing
+ */
+void read_bcast_batch(struct iface *ifa)
+{
+    struct if_bcast *ifb=(struct if_bcast *) ifa->info;
+    struct rdstate rs;
+    struct dgram *dg;
+    int i,n;
+
+    if ((dg=alloc_dgrams(ifb->rxbatch)) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        iface_thread_exit(errno);
+    }
+
+    init_rdstate(ifa,&rs);
+    if (ifa->stats)
+        rxstamp_on(ifb->fd);
+
+    while ((n=recv_batch(ifb->fd,dg,ifb->rxbatch,ifb->rxwait)) > 0)
+        for (i=0;i<n;i++)
+            if (!bcast_ignored((struct sockaddr_in *) &dg[i].src,
+                    dg[i].srclen)) {
+                rs.stamp=dg[i].stamp;
+                parse_buf(ifa,&rs,dg[i].buf,dg[i].len);
+            }
+
+    free(dg);
+    iface_thread_exit(errno);
+}
+
 struct iface *init_bcast(struct iface *ifa)
 {
     struct if_bcast *ifb;
@@ -216,12 +252,14 @@ struct iface *init_bcast(struct iface *ifa)
     struct ignore_addr **igpp,*newig;
     size_t qsize = DEFBCASTQSIZE;
     struct kopts *opt;
+    int ret;
     
     if ((ifb=malloc(sizeof(struct if_bcast))) == NULL) {
         logerr(errno,"Could not allocate memory");
         return(NULL);
     }
     memset(ifb,0,sizeof(struct if_bcast));
+    ifb->rxbatch=DEFRXBATCH;
 
 #if 0
     if (pthread_once(&bcast_init,init_bcast_lock) != 0 ||
@@ -234,6 +272,12 @@ struct iface *init_bcast(struct iface *ifa)
     ifname=bname=NULL;
 
     for(opt=ifa->options;opt;opt=opt->next) {
+        if ((ret=parse_rxbatch(opt,ifa,&ifb->rxbatch,&ifb->rxwait)) < 0 ||
+                (ret == 0 &&
+                (ret=parse_pack(opt,ifa,&ifb->pack,&ifb->maxhold)) < 0))
+            return(NULL);
+        else if (ret)
+            continue;
         if (!strcasecmp(opt->var,"device"))
             ifname=opt->val;
         else if (!strcasecmp(opt->var,"address")) {
@@ -388,6 +432,8 @@ struct iface *init_bcast(struct iface *ifa)
         pthread_rwlock_unlock(&sysaddr_lock);
 #endif
 
+        if (ifb->pack == PACKMTU)
+            ifb->pack=mtu_payload(AF_INET,ifname);
         /* write queue initialization */
         if (init_q(ifa,qsize) < 0) {
             logerr(errno,"Could not create queue");
@@ -396,7 +442,7 @@ struct iface *init_bcast(struct iface *ifa)
     }
 
     ifa->write=write_bcast;
-    ifa->read=do_read;
+    ifa->read=(ifb->rxbatch > 1)?read_bcast_batch:do_read;
     ifa->readbuf=read_bcast;
     ifa->cleanup=cleanup_bcast;
     ifa->info = (void *) ifb;
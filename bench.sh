@@ -0,0 +1,168 @@
+#!/bin/sh
+# bench.sh
+# This file is part of kplex
+# Copyright Keith Young 2012 - 2016
+# For copying information see the file COPYING distributed with this software
+#
+# Engine throughput and latency benchmark.  Drives kplex with a generator
+# input (or a recorded corpus) flat out into 1, 10, 100 and 1000 null outputs
+# and reports figures gathered from the statistics server.  Run by "make bench"
+#
+# Environment:
+#   KPLEX           kplex binary (default ./kplex)
+#   BENCH_OUTPUTS   numbers of outputs to test (default "1 10 100 1000")
+#   BENCH_TIME      seconds to measure each run for (default 5)
+#   BENCH_ENGINES   engine threads (default 1)
+#   BENCH_INPUTS    generator inputs (default 1).  Each input is handled by
+#                   one engine thread so more engines need more inputs
+#   BENCH_MIX       generator sentence mix (default generator mix)
+#   BENCH_CORPUS    file of recorded sentences to replay in a loop as well
+#
+# Columns:
+#   in/s      sentences per second processed by the engine
+#   ns/sen    wall clock time per sentence through the engine (1e9 / in/s)
+#   out/s     sentences per second written, summed over all outputs
+#   drops     sentences lost from full queues (inputs and outputs)
+#   p50..max  read to write latency in microseconds, worst output
+
+KPLEX=${KPLEX:-./kplex}
+BENCH_OUTPUTS=${BENCH_OUTPUTS:-"1 10 100 1000"}
+BENCH_TIME=${BENCH_TIME:-5}
+BENCH_ENGINES=${BENCH_ENGINES:-1}
+BENCH_INPUTS=${BENCH_INPUTS:-1}
+WARMUP=1
+status=0
+
+# Filters contain '*'s
+set -f
+
+if [ ! -x "$KPLEX" ]; then
+    echo "$KPLEX not found" >&2
+    exit 1
+fi
+if ! command -v curl >/dev/null 2>&1; then
+    echo "bench requires curl" >&2
+    exit 1
+fi
+
+DIR=`mktemp -d ${TMPDIR:-/tmp}/kplex-bench.XXXXXX` || exit 1
+SOCK=$DIR/stats
+trap 'rm -rf "$DIR"' EXIT
+trap 'exit 1' INT TERM
+
+getstats() {
+    curl -s --unix-socket "$SOCK" http://localhost/stats > "$1"
+}
+
+# Flatten the JSON statistics from two samples into "file name key value"
+# lines and work out the figures for one run
+report() {
+    awk -v t="$BENCH_TIME" -v label="$1" -v n="$2" '
+    {
+        gsub(/\{/,"{,"); gsub(/\}/,",},")
+        cnt=split($0,tok,",")
+        pfx=""; name=""
+        for (i=1;i<=cnt;i++) {
+            if (tok[i] == "}") { pfx=""; continue }
+            if (match(tok[i],/^"[^"]*":/) == 0)
+                continue
+            key=substr(tok[i],2,RLENGTH-3)
+            val=substr(tok[i],RLENGTH+1)
+            if (val == "{") { pfx=key "."; continue }
+            gsub(/"/,"",val)
+            if (key == "name") { name=val; type="" ; continue }
+            if (key == "type") { type=val; types[name]=val; continue }
+            v[FILENAME, name, pfx key]=val
+            names[name]=1
+        }
+    }
+    FNR == 1 { files[++nf]=FILENAME }
+    END {
+        a=files[1]; b=files[2]
+        for (nm in names) {
+            d=v[b,nm,"drops"]-v[a,nm,"drops"]
+            drops+=d
+            if (types[nm] != "null")
+                edrops+=d
+            if (types[nm] == "null") {
+                out+=v[b,nm,"outsentences"]-v[a,nm,"outsentences"]
+                if (v[b,nm,"total.p50"] > p50) p50=v[b,nm,"total.p50"]
+                if (v[b,nm,"total.p99"] > p99) p99=v[b,nm,"total.p99"]
+                if (v[b,nm,"total.p999"] > p999) p999=v[b,nm,"total.p999"]
+                if (v[b,nm,"total.max"] > max) max=v[b,nm,"total.max"]
+            } else
+                nin+=v[b,nm,"insentences"]-v[a,nm,"insentences"]
+        }
+        rate=(nin-edrops)/t
+        printf "%-10s %7d %10.0f %8.0f %11.0f %10d %7d %7d %7d %8d\n",
+                label,n,rate,(rate>0)?1e9/rate:0,out/t,drops,p50,p99,p999,max
+    }' "$DIR/a" "$DIR/b"
+}
+
+# Args: label, number of outputs, input interfaces, global options...
+run() {
+    label=$1; n=$2; input=$3
+    shift 3
+    outs=""
+    i=0
+    while [ $i -lt $n ]; do
+        outs="$outs null:$OUTOPTS"
+        i=`expr $i + 1`
+    done
+    rm -f "$SOCK"
+    "$KPLEX" -f - -o stats=$SOCK -o engines=$BENCH_ENGINES "$@" $input $outs \
+            2>"$DIR/err" &
+    pid=$!
+    sleep $WARMUP
+    if ! getstats "$DIR/a"; then
+        echo "$label: kplex failed to start:" >&2
+        cat "$DIR/err" >&2
+        kill $pid 2>/dev/null
+        wait $pid 2>/dev/null
+        return 1
+    fi
+    sleep $BENCH_TIME
+    getstats "$DIR/b"
+    # Orderly shutdown of hundreds of interfaces takes a while and we've got
+    # what we came for
+    kill -KILL $pid 2>/dev/null
+    wait $pid 2>/dev/null
+    report "$label" "$n"
+}
+
+# The first generator is "gen", which the failover rule below refers to
+GEN=
+i=1
+while [ $i -le $BENCH_INPUTS ]; do
+    GEN="$GEN generator:name=gen${i#1},seed=$i,rate=0,checksum=yes${BENCH_MIX:+,mix=$BENCH_MIX}"
+    i=`expr $i + 1`
+done
+
+printf "%-10s %7s %10s %8s %11s %10s %7s %7s %7s %8s\n" run outputs in/s \
+        ns/sen out/s drops p50 p99 p999 max
+
+for n in $BENCH_OUTPUTS; do
+    OUTOPTS=
+    run synthetic $n "$GEN" || status=1
+done
+
+# Same again with output filters and failover, so that every sentence goes
+# through senfilter() and isactive()
+for n in $BENCH_OUTPUTS; do
+    OUTOPTS="ofilter=+GP***:+HE***:+AI***:-all"
+    run filtered $n "$GEN" -o "failover=GP***:0:gen" || status=1
+done
+
+if [ -n "$BENCH_CORPUS" ]; then
+    mkfifo "$DIR/fifo" || exit 1
+    for n in $BENCH_OUTPUTS; do
+        OUTOPTS=
+        (while :; do cat "$BENCH_CORPUS" || exit 1; done) > "$DIR/fifo" &
+        feeder=$!
+        run corpus $n "file:filename=$DIR/fifo,direction=in,checksum=yes" || status=1
+        kill $feeder 2>/dev/null
+        wait $feeder 2>/dev/null
+    done
+fi
+
+exit $status
@@ -0,0 +1,532 @@
+/* evloop.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2016
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Event loop workers.  By default every interface gets its own thread (two
+ * for bi-directional tcp connections).  With the "workers" global option,
+ * connections accepted by tcp servers are instead multiplexed over a small
+ * number of worker threads, each running an epoll loop over the sockets it
+ * handles and the event fds its output queues kick when data arrives.
+ * Reading is done with the same parser as do_read() and writing with the
+ * same batch routines as the threaded writers, but neither ever blocks.
+ */
+
+#include "kplex.h"
+#include <signal.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#endif
+
+#define EVMAXEVENTS 64
+/* Reads per readiness notification before giving other connections a go */
+#define EVMAXREADS 16
+/* Batches written per wakeup before giving other connections a go */
+#define EVMAXBATCHES 8
+/* Space for a batch of sentences which couldn't be written immediately */
+#define EVPENDSZ (BATCHMAX*(TAGMAX+SENBUFSZ))
+
+extern pthread_t reaper;
+
+#ifdef __linux__
+
+struct evworker;
+
+/* What an epoll event refers to: a connection's socket or its queue */
+struct evsrc {
+    struct evconn *conn;
+    int isq;
+};
+
+struct evconn {
+    iface_t *in;            /* Input half (NULL if none or gone) */
+    iface_t *out;           /* Output half (NULL if none or gone) */
+    int fd;
+    int evfd;
+    int killed;
+    int pollout;
+    int dead;
+    struct evconn *nextdead;
+    struct evworker *w;
+    struct evsrc sock;
+    struct evsrc qsrc;
+    struct rdstate rs;
+    char *tbuf;
+    char *pend;             /* Unwritten output */
+    size_t plen;
+    size_t poff;
+};
+
+struct evworker {
+    int epfd;
+    pthread_t tid;
+    pthread_mutex_t lock;   /* Held while handling events or adding to epfd */
+    struct evconn *dead;    /* Closed connections awaiting freeing */
+};
+
+static struct evworker *workers;
+static int nworkers;
+static unsigned int nextworker;
+
+/*
+ * Remove one half of a connection from the engine's lists
+ * Args: connection, pointer to the half to be removed
+ * Returns: Nothing
+ * Side effects: Interface is unlinked and queued for the reaper, which frees
+ * it.  The half's pointer in the connection is cleared.
+ */
+static void ev_unlink(struct evconn *c, iface_t **half)
+{
+    iface_t *ifa=*half;
+
+    *half=NULL;
+    DEBUG(3,"Cleaning up data for exiting %s connection %s id %x",
+            (ifa->direction == IN)?"input":"output",ifa->name,ifa->id);
+    pthread_mutex_lock(&ifa->lists->io_mutex);
+    unlink_interface(ifa);
+    (void) pthread_kill(reaper,SIGUSR2);
+    pthread_mutex_unlock(&ifa->lists->io_mutex);
+}
+
+/*
+ * Shut down a connection, or one half of it
+ * Args: connection, flag indicating only the input half is to go
+ * Returns: Nothing
+ * Side effects: If nothing remains of the connection, its fds are closed
+ * and it is queued to be freed once the worker has finished with the
+ * current set of events, any of which might refer to it
+ */
+static void ev_close(struct evconn *c, int inonly)
+{
+    struct epoll_event ev;
+
+    if (c->in) {
+        ev_unlink(c,&c->in);
+        if (inonly && c->out) {
+            /* Stop listening for input but carry on writing */
+            ev.events=c->pollout?EPOLLOUT:0;
+            ev.data.ptr=&c->sock;
+            (void) epoll_ctl(c->w->epfd,EPOLL_CTL_MOD,c->fd,&ev);
+            return;
+        }
+    }
+
+    (void) epoll_ctl(c->w->epfd,EPOLL_CTL_DEL,c->fd,NULL);
+    if (c->evfd >= 0)
+        (void) epoll_ctl(c->w->epfd,EPOLL_CTL_DEL,c->evfd,NULL);
+
+    if (c->out)
+        ev_unlink(c,&c->out);
+
+    /* The socket belongs to us, not the interfaces */
+    close(c->fd);
+    if (c->evfd >= 0)
+        close(c->evfd);
+    c->dead=1;
+    c->nextdead=c->w->dead;
+    c->w->dead=c;
+}
+
+/*
+ * Read whatever is available on a connection
+ * Args: connection
+ * Returns: 0 if the connection is still open, -1 if it has been closed
+ */
+static int ev_read(struct evconn *c)
+{
+    char buf[BUFSIZ];
+    ssize_t nread;
+    int i;
+
+    for (i=0;i<EVMAXREADS;i++) {
+        if ((nread=read(c->fd,buf,BUFSIZ)) > 0) {
+            parse_buf(c->in,&c->rs,buf,nread);
+            continue;
+        }
+        if (nread < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (nread < 0 && errno == EINTR)
+            continue;
+        /* End of file or error: Input is done with.  Writing can continue
+         * as it would for a thread whose pair had exited */
+        ev_close(c,1);
+        return(c->out?0:-1);
+    }
+    return(0);
+}
+
+/*
+ * Enable or disable notification of a connection's socket being writable
+ * Args: connection, flag
+ * Returns: Nothing
+ */
+static void ev_pollout(struct evconn *c, int on)
+{
+    struct epoll_event ev;
+
+    if (c->pollout == on)
+        return;
+    c->pollout=on;
+    ev.events=(c->in?EPOLLIN:0)|(on?EPOLLOUT:0);
+    ev.data.ptr=&c->sock;
+    (void) epoll_ctl(c->w->epfd,EPOLL_CTL_MOD,c->fd,&ev);
+}
+
+/*
+ * Write out as much as possible from an iovec array without blocking,
+ * saving the rest to the connection's pending buffer
+ * Args: connection, iovec array, number of iovecs
+ * Returns: 0 on success (including saving unwritten data), -1 on error
+ */
+static int ev_writev(struct evconn *c, struct iovec *iov, int cnt)
+{
+    ssize_t n;
+
+    while ((n=writev(c->fd,iov,cnt)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            n=0;
+            break;
+        }
+        if (errno != EINTR)
+            return(-1);
+    }
+
+    for (;cnt && n >= (ssize_t) iov->iov_len;cnt--,iov++)
+        n-=iov->iov_len;
+
+    if (cnt == 0)
+        return(0);
+
+    if (c->pend == NULL && (c->pend=malloc(EVPENDSZ)) == NULL)
+        return(-1);
+
+    for (c->plen=c->poff=0;cnt;cnt--,iov++,n=0) {
+        memcpy(c->pend+c->plen,(char *) iov->iov_base+n,iov->iov_len-n);
+        c->plen+=iov->iov_len-n;
+    }
+    ev_pollout(c,1);
+    return(0);
+}
+
+/*
+ * Write data pending from an earlier partial write
+ * Args: connection
+ * Returns: 1 if everything was written, 0 if some remains, -1 on error
+ */
+static int ev_flush(struct evconn *c)
+{
+    ssize_t n;
+
+    while (c->poff < c->plen) {
+        if ((n=write(c->fd,c->pend+c->poff,c->plen-c->poff)) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return(0);
+            if (errno == EINTR)
+                continue;
+            return(-1);
+        }
+        c->poff+=n;
+    }
+    c->plen=c->poff=0;
+    ev_pollout(c,0);
+    return(1);
+}
+
+/*
+ * Write out whatever is queued for a connection
+ * Args: connection
+ * Returns: 0 if the connection is still open, -1 if it has been closed
+ */
+static int ev_write(struct evconn *c)
+{
+    senblk_t *vec[BATCHMAX];
+    struct iovec iov[BATCHIOV];
+    uint64_t one=1;
+    size_t n;
+    int stride,ret,i;
+
+    for (i=0;;i++) {
+        if (i == EVMAXBATCHES) {
+            /* Come back to this later.  Our queue won't kick us because
+             * we're not waiting so do it ourselves */
+            (void) write(c->evfd,&one,sizeof(one));
+            return(0);
+        }
+
+        if (c->plen && (ret=ev_flush(c)) <= 0) {
+            if (ret == 0)
+                return(0);
+            break;
+        }
+
+        if ((n=poll_senblk_batch(c->out->q,vec,BATCHMAX)) == 0) {
+            if (c->out->q->active)
+                return(0);
+            /* Queue shut down and drained */
+            break;
+        }
+
+        stride=senblk_iov(c->out,vec,&n,iov,c->tbuf,0);
+        ret=n?ev_writev(c,iov,n*stride):0;
+        senblk_free_batch(vec,n,c->out->q);
+        if (ret < 0) {
+            DEBUG2(3,"%s id %x: write failed",c->out->name,c->out->id);
+            break;
+        }
+    }
+
+    ev_close(c,0);
+    return(-1);
+}
+
+/*
+ * Event loop worker thread
+ * Args: pointer to worker structure (cast to void *)
+ * Returns: Nothing
+ */
+static void *ev_run(void *arg)
+{
+    struct evworker *w = (struct evworker *) arg;
+    struct epoll_event evs[EVMAXEVENTS];
+    struct evsrc *src;
+    struct evconn *c;
+    uint64_t count;
+    int i,n;
+
+    (void) pthread_detach(pthread_self());
+
+    for (;;) {
+        if ((n=epoll_wait(w->epfd,evs,EVMAXEVENTS,-1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            logterm(errno,"Event loop failed");
+        }
+
+        /* Connections being added have their events held off until they're
+         * complete.  See ev_add_conn() */
+        pthread_mutex_lock(&w->lock);
+        for (i=0;i<n;i++) {
+            src=(struct evsrc *) evs[i].data.ptr;
+            if ((c=src->conn)->dead)
+                continue;
+
+            if (src->isq) {
+                (void) read(c->evfd,&count,sizeof(count));
+                if (__atomic_load_n(&c->killed,__ATOMIC_ACQUIRE)) {
+                    ev_close(c,0);
+                    continue;
+                }
+                if (c->out)
+                    (void) ev_write(c);
+                continue;
+            }
+
+            if (c->in && (evs[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR))) {
+                if (ev_read(c) < 0)
+                    continue;
+            } else if (c->out && c->pollout == 0 &&
+                    (evs[i].events & (EPOLLHUP|EPOLLERR))) {
+                /* Output only connection closed by the peer */
+                ev_close(c,0);
+                continue;
+            }
+
+            if (c->out && (evs[i].events & EPOLLOUT))
+                (void) ev_write(c);
+        }
+
+        while ((c=w->dead) != NULL) {
+            w->dead=c->nextdead;
+            if (c->tbuf)
+                free(c->tbuf);
+            if (c->pend)
+                free(c->pend);
+            free(c);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    return(NULL);
+}
+
+/*
+ * Start event loop worker threads
+ * Args: Number of workers
+ * Returns: 0 on success, -1 on failure
+ * Should be called with the signals interface threads don't handle blocked
+ */
+int ev_init(int n)
+{
+    int i;
+
+    if ((workers=(struct evworker *) calloc(n,sizeof(struct evworker))) == NULL)
+        return(-1);
+
+    for (i=0;i<n;i++) {
+        if ((workers[i].epfd=epoll_create1(EPOLL_CLOEXEC)) < 0)
+            return(-1);
+        pthread_mutex_init(&workers[i].lock,NULL);
+        if (pthread_create(&workers[i].tid,NULL,ev_run,&workers[i]))
+            return(-1);
+        nworkers++;
+    }
+    DEBUG(3,"Started %d event loop workers",n);
+    return(0);
+}
+
+/*
+ * Hand a connection over to an event loop worker
+ * Args: output and input halves of the connection (either may be NULL),
+ * socket
+ * Returns: 0 on success, -1 on failure
+ * Side effects: Interfaces are linked into the engine's output and input
+ * lists.  On failure they are left as they were, the socket is returned to
+ * blocking mode and the caller may start threads for them instead
+ */
+int ev_add_conn(iface_t *out, iface_t *in, int fd)
+{
+    struct evconn *c;
+    struct epoll_event ev;
+    struct evworker *w;
+    iface_t *ifa;
+    iface_t **lptr;
+    uint64_t one=1;
+    int i,flags,err;
+
+    if ((c=(struct evconn *) malloc(sizeof(struct evconn))) == NULL)
+        return(-1);
+    memset(c,0,sizeof(struct evconn));
+
+    c->fd=fd;
+    c->evfd=-1;
+    c->in=in;
+    c->out=out;
+    c->w=w=&workers[__atomic_fetch_add(&nextworker,1,__ATOMIC_RELAXED) %
+            nworkers];
+    c->sock.conn=c->qsrc.conn=c;
+    c->qsrc.isq=1;
+
+    if ((flags=fcntl(fd,F_GETFL)) < 0 ||
+            (c->evfd=eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC)) < 0 ||
+            (out && out->tagflags &&
+            (c->tbuf=malloc(TAGMAX*BATCHMAX)) == NULL) ||
+            fcntl(fd,F_SETFL,flags|O_NONBLOCK) < 0) {
+        if (c->evfd >= 0)
+            close(c->evfd);
+        if (c->tbuf)
+            free(c->tbuf);
+        free(c);
+        return(-1);
+    }
+
+    if (in)
+        init_rdstate(in,&c->rs);
+
+    /* The worker won't act on anything for this connection until we let go
+     * of its lock, by which time the connection is complete.  Until then
+     * nothing else knows about it, so it can't be killed either */
+    pthread_mutex_lock(&w->lock);
+    /* The event fd goes in first.  Nothing has been written to it, so if
+     * adding the socket fails no event can have been returned for either
+     * and we can free the connection straight away */
+    ev.events=EPOLLIN;
+    ev.data.ptr=&c->qsrc;
+    if (epoll_ctl(w->epfd,EPOLL_CTL_ADD,c->evfd,&ev) < 0)
+        err=errno;
+    else {
+        ev.events=in?EPOLLIN:0;
+        ev.data.ptr=&c->sock;
+        if ((err=(epoll_ctl(w->epfd,EPOLL_CTL_ADD,fd,&ev) < 0)?errno:0))
+            (void) epoll_ctl(w->epfd,EPOLL_CTL_DEL,c->evfd,NULL);
+    }
+    if (err) {
+        logerr(err,"Failed to add connection to event loop");
+        pthread_mutex_unlock(&w->lock);
+        (void) fcntl(fd,F_SETFL,flags);
+        close(c->evfd);
+        if (c->tbuf)
+            free(c->tbuf);
+        free(c);
+        return(-1);
+    }
+
+    for (i=0;i<2;i++) {
+        if ((ifa=(i?in:out)) == NULL)
+            continue;
+        ifa->evc=c;
+        ifa->tid=0;
+        flag_set(ifa,F_EVLOOP);
+    }
+
+    if (out)
+        out->q->evfd=c->evfd;
+
+    pthread_mutex_lock(&(in?in:out)->lists->io_mutex);
+    for (i=0;i<2;i++) {
+        if ((ifa=(i?in:out)) == NULL)
+            continue;
+        lptr=(ifa->direction==IN)?&ifa->lists->inputs:&ifa->lists->outputs;
+        ifa->next=(*lptr);
+        (*lptr)=ifa;
+        if (ifa == out)
+            publish_outputs(out->lists,out);
+    }
+    pthread_mutex_unlock(&(in?in:out)->lists->io_mutex);
+
+    /* Have the worker check the queue, which tells it we're waiting */
+    (void) write(c->evfd,&one,sizeof(one));
+    pthread_mutex_unlock(&w->lock);
+    return(0);
+}
+
+/*
+ * Tell the event loop to shut down a connection
+ * Args: Either half of the connection
+ * Returns: Nothing
+ * Should be called with io_mutex held so that the connection can't go away
+ * underneath us
+ */
+void ev_kill(iface_t *ifa)
+{
+    uint64_t one=1;
+
+    __atomic_store_n(&ifa->evc->killed,1,__ATOMIC_RELEASE);
+    (void) write(ifa->evc->evfd,&one,sizeof(one));
+}
+
+/*
+ * Check whether event loop workers are running
+ * Args: None
+ * Returns: Number of workers
+ */
+int ev_active(void)
+{
+    return(nworkers);
+}
+
+#else
+
+int ev_init(int n)
+{
+    logerr(0,"Event loop workers are not supported on this platform");
+    return(-1);
+}
+
+int ev_add_conn(iface_t *out, iface_t *in, int fd)
+{
+    return(-1);
+}
+
+void ev_kill(iface_t *ifa)
+{
+}
+
+int ev_active(void)
+{
+    return(0);
+}
+
+#endif
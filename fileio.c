@@ -56,11 +56,12 @@ void cleanup_file(iface_t *ifa)
 void write_file(iface_t *ifa)
 {
     struct if_file *ifc = (struct if_file *) ifa->info;
-    senblk_t *sptr;
-    int usereturn=flag_test(ifa,F_NOCR)?0:1;
-    int data=0;
-    int cnt=1;
-    struct iovec iov[2];
+    senblk_t *vec[BATCHMAX];
+    struct iovec iov[BATCHIOV];
+    size_t n;
+    int nocr=flag_test(ifa,F_NOCR)?1:0;
+    int stride;
+    char *tbuf=NULL;
 
     /* ifc->fd will only be < 0 if we're opening a FIFO.
      */
@@ -77,60 +78,44 @@ void write_file(iface_t *ifa)
     }
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*BATCHMAX)) == NULL) {
                 logerr(errno,"%s: Disabing tag output",ifa->name);
                 ifa->tagflags=0;
-        } else {
-            cnt=2;
-            data=1;
         }
     }
 
-
     for(;;)  {
-        if ((sptr = next_senblk(ifa->q)) == NULL) {
+        if ((n = next_senblk_batch(ifa->q,vec,BATCHMAX)) == 0) {
             break;
         }
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
+        /* senblks are shared with other outputs so line endings are
+         * substituted in the iovecs rather than in sentence data */
+        stride=senblk_iov(ifa,vec,&n,iov,tbuf,nocr);
+        if (n == 0)
             continue;
-        }
-
-        if (!usereturn) {
-            sptr->data[sptr->len-2] = '\n';
-            sptr->len--;
-        }
-
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"%s: Disabing tag output",ifa->name);
-                ifa->tagflags=0;
-                cnt=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
 
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
-        if (writev(ifc->fd,iov,cnt) <0) {
+        if (writev_all(ifc->fd,iov,n*stride) <0) {
             if (!(flag_test(ifa,F_PERSIST) && errno == EPIPE) ) {
                 logerr(errno,"%s: write failed",ifa->name);
+                senblk_free_batch(vec,n,ifa->q);
                 break;
             }
 
             if ((ifc->fd=open(ifc->filename,O_WRONLY)) < 0) {
                 logerr(errno,"%s: failed to re-open %s",ifa->name,
                         ifc->filename);
+                senblk_free_batch(vec,n,ifa->q);
                 break;
             }
             DEBUG(4,"%s: reconnected to FIFO %s",ifa->name,ifc->filename);
+            stat_add(ifa,reconnects,1);
         }
-        senblk_free(sptr,ifa->q);
+        senblk_free_batch(vec,n,ifa->q);
     }
 
-    if (cnt == 2)
-        free(iov[0].iov_base);
+    if (tbuf)
+        free(tbuf);
 
     iface_thread_exit(errno);
 }
@@ -167,6 +152,7 @@ ssize_t read_file(iface_t *ifa, char *buf)
                 break;
             }
             DEBUG(4,"%s: re-opened %s for reading",ifa->name,ifc->filename);
+            stat_add(ifa,reconnects,1);
             continue;
         } else
             break;
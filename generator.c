@@ -0,0 +1,579 @@
+/* generator.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012 - 2016
+ * For copying information see the file COPYING distributed with this software
+ *
+ * This file contains code for synthetic sentence generation and for a null
+ * output which discards everything it is sent.  Between them they allow the
+ * engine and output paths to be exercised without any real devices
+ */
+
+#include "kplex.h"
+#include <stdlib.h>
+#include <math.h>
+#include <sys/uio.h>
+
+#define DEFGENMIX "rmc:gga:hdt:vdm*5"
+#define DEFNULLQSIZE 128
+#define GENVESSELS 64
+
+enum genpattern {
+    GEN_FIXED,
+    GEN_POISSON,
+    GEN_BURSTY
+};
+
+/* Simulated own-ship state, advanced once per sentence */
+struct genstate {
+    uint64_t seq;
+    uint64_t rng;
+    double lat;
+    double lon;
+    double cog;
+    double sog;
+};
+
+struct gentype {
+    char *name;
+    int (*fmt)(char *, struct genstate *);
+};
+
+struct if_gen {
+    struct gentype **mix;       /* one entry per unit of weight */
+    size_t nmix;
+    double interval;            /* mean ns between sentences. 0 for no limit */
+    enum genpattern pattern;
+    unsigned long burst;
+    unsigned long count;        /* 0 for no limit */
+    unsigned long sent;
+    int tag;
+    uint64_t next;              /* monotonic ns at which next sentence is due */
+    struct genstate gs;
+};
+
+/*
+ * xorshift64* pseudo-random number generator.  Statistical quality is ample
+ * for test data and it's reproducible from a given seed
+ * Args: pointer to generator state
+ * Returns: next pseudo-random number
+ */
+static uint64_t gen_rand(struct genstate *gs)
+{
+    gs->rng ^= gs->rng >> 12;
+    gs->rng ^= gs->rng << 25;
+    gs->rng ^= gs->rng >> 27;
+    return(gs->rng * 0x2545F4914F6CDD1DULL);
+}
+
+/* Uniform pseudo-random number in [0,1) */
+static double gen_unit(struct genstate *gs)
+{
+    return((gen_rand(gs) >> 11) * (1.0/9007199254740992.0));
+}
+
+static uint64_t gen_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return((uint64_t) ts.tv_sec*1000000000+ts.tv_nsec);
+}
+
+/*
+ * Format a latitude or longitude as NMEA ddmm.mmmm,H
+ * Args: buffer, value in degrees, number of degree digits, hemisphere chars
+ * Returns: number of characters written
+ */
+static int gen_pos(char *buf, double deg, int digits, char *hemi)
+{
+    char h=hemi[0];
+    int d;
+
+    if (deg < 0) {
+        deg=-deg;
+        h=hemi[1];
+    }
+    d=(int) deg;
+    return(sprintf(buf,"%0*d%07.4f,%c",digits,d,(deg-d)*60,h));
+}
+
+static int gen_utc(char *buf, struct tm *tm)
+{
+    return(sprintf(buf,"%02d%02d%02d.00",tm->tm_hour,tm->tm_min,tm->tm_sec));
+}
+
+static void gen_time(struct tm *tm)
+{
+    time_t t=time(NULL);
+
+    gmtime_r(&t,tm);
+}
+
+static int gen_rmc(char *buf, struct genstate *gs)
+{
+    char *ptr=buf;
+    struct tm tm;
+
+    gen_time(&tm);
+    ptr+=sprintf(ptr,"$GPRMC,");
+    ptr+=gen_utc(ptr,&tm);
+    ptr+=sprintf(ptr,",A,");
+    ptr+=gen_pos(ptr,gs->lat,2,"NS");
+    *ptr++=',';
+    ptr+=gen_pos(ptr,gs->lon,3,"EW");
+    ptr+=sprintf(ptr,",%.1f,%.1f,%02d%02d%02d,,,A",gs->sog,gs->cog,tm.tm_mday,
+            tm.tm_mon+1,tm.tm_year%100);
+    return(ptr-buf);
+}
+
+static int gen_gga(char *buf, struct genstate *gs)
+{
+    char *ptr=buf;
+    struct tm tm;
+
+    gen_time(&tm);
+    ptr+=sprintf(ptr,"$GPGGA,");
+    ptr+=gen_utc(ptr,&tm);
+    *ptr++=',';
+    ptr+=gen_pos(ptr,gs->lat,2,"NS");
+    *ptr++=',';
+    ptr+=gen_pos(ptr,gs->lon,3,"EW");
+    ptr+=sprintf(ptr,",1,%02d,%.1f,%.1f,M,47.0,M,,",
+            6+(int)(gen_rand(gs)%7),0.8+gen_unit(gs),2+gen_unit(gs)*3);
+    return(ptr-buf);
+}
+
+static int gen_hdt(char *buf, struct genstate *gs)
+{
+    return(sprintf(buf,"$HEHDT,%.1f,T",fmod(gs->cog+gen_unit(gs)*4+358,360)));
+}
+
+static int gen_vtg(char *buf, struct genstate *gs)
+{
+    return(sprintf(buf,"$GPVTG,%.1f,T,,M,%.1f,N,%.1f,K,A",gs->cog,gs->sog,
+            gs->sog*1.852));
+}
+
+static int gen_mwv(char *buf, struct genstate *gs)
+{
+    return(sprintf(buf,"$WIMWV,%.1f,R,%.1f,N,A",gen_unit(gs)*360,
+            8+gen_unit(gs)*10));
+}
+
+static int gen_dpt(char *buf, struct genstate *gs)
+{
+    return(sprintf(buf,"$SDDPT,%.1f,0.5,",12+gen_unit(gs)*4));
+}
+
+/*
+ * Append an unsigned field to a 6-bit packed AIS payload
+ * Args: bit array (one bit per byte), current bit offset, number of bits,
+ * value
+ * Returns: new bit offset
+ */
+static int ais_bits(unsigned char *bits, int off, int n, uint32_t val)
+{
+    while (n--)
+        bits[off++]=(val>>n)&1;
+    return(off);
+}
+
+/* AIS message type 1 position report from one of GENVESSELS vessels
+ * scattered around own ship */
+static int gen_vdm(char *buf, struct genstate *gs)
+{
+    unsigned char bits[168];
+    char *ptr=buf;
+    unsigned int v=gen_rand(gs)%GENVESSELS;
+    int off=0,i,c;
+
+    off=ais_bits(bits,off,6,1);
+    off=ais_bits(bits,off,2,0);
+    off=ais_bits(bits,off,30,235000000+v);
+    off=ais_bits(bits,off,4,0);
+    off=ais_bits(bits,off,8,128);
+    off=ais_bits(bits,off,10,gen_rand(gs)%200);
+    off=ais_bits(bits,off,1,0);
+    off=ais_bits(bits,off,28,
+            (uint32_t)(int32_t)((gs->lon+(v%8)*0.01)*600000));
+    off=ais_bits(bits,off,27,
+            (uint32_t)(int32_t)((gs->lat+(v/8)*0.01)*600000));
+    off=ais_bits(bits,off,12,gen_rand(gs)%3600);
+    off=ais_bits(bits,off,9,gen_rand(gs)%360);
+    off=ais_bits(bits,off,6,(unsigned)(gs->seq%60));
+    off=ais_bits(bits,off,2,0);
+    off=ais_bits(bits,off,3,0);
+    off=ais_bits(bits,off,1,0);
+    off=ais_bits(bits,off,19,0);
+
+    ptr+=sprintf(ptr,"!AIVDM,1,1,,%c,",(v&1)?'B':'A');
+    for (i=0;i<off;i+=6) {
+        c=(bits[i]<<5)|(bits[i+1]<<4)|(bits[i+2]<<3)|(bits[i+3]<<2)|
+                (bits[i+4]<<1)|bits[i+5];
+        *ptr++=(c<40)?c+48:c+56;
+    }
+    ptr+=sprintf(ptr,",0");
+    return(ptr-buf);
+}
+
+static struct gentype gentypes[] = {
+    { "rmc", gen_rmc },
+    { "gga", gen_gga },
+    { "hdt", gen_hdt },
+    { "vtg", gen_vtg },
+    { "mwv", gen_mwv },
+    { "dpt", gen_dpt },
+    { "vdm", gen_vdm },
+    { NULL, NULL }
+};
+
+/*
+ * Parse a sentence mix specification of the form <type>[*<weight>][:...]
+ * Args: generator info, specification string
+ * Returns: 0 on success, -1 on error
+ * Side effects: ifg->mix allocated with one entry per unit of weight
+ */
+static int parse_mix(struct if_gen *ifg, char *spec)
+{
+    char *cp,*sp,*ep;
+    struct gentype *gt;
+    unsigned long w;
+    size_t n=0,max=0;
+    struct gentype **mix=NULL,**tmix;
+
+    for (cp=spec;cp;cp=ep) {
+        if ((ep=strchr(cp,':')) != NULL)
+            *ep++='\0';
+        w=1;
+        if ((sp=strchr(cp,'*')) != NULL) {
+            *sp++='\0';
+            if ((w=strtoul(sp,&sp,10)) == 0 || w > 1000 || *sp) {
+                logerr(0,"Invalid weight for sentence type %s",cp);
+                break;
+            }
+        }
+        for (gt=gentypes;gt->name;gt++)
+            if (!strcasecmp(gt->name,cp))
+                break;
+        if (gt->name == NULL) {
+            logerr(0,"Unknown generator sentence type \"%s\"",cp);
+            break;
+        }
+        if (n+w > max) {
+            max=n+w+16;
+            if ((tmix=realloc(mix,max*sizeof(struct gentype *))) == NULL) {
+                logerr(errno,"Could not allocate memory");
+                break;
+            }
+            mix=tmix;
+        }
+        while (w--)
+            mix[n++]=gt;
+    }
+
+    if (cp || n == 0) {
+        if (n == 0 && cp == NULL)
+            logerr(0,"Empty generator mix");
+        free(mix);
+        return(-1);
+    }
+    if (ifg->mix)
+        free(ifg->mix);
+    ifg->mix=mix;
+    ifg->nmix=n;
+    return(0);
+}
+
+/*
+ * Generate a single sentence with checksum and line termination
+ * Args: Interface pointer, generator info, buffer (at least TAGMAX+SENMAX+3)
+ * Returns: number of characters written
+ */
+static size_t gen_sentence(iface_t *ifa, struct if_gen *ifg, char *buf)
+{
+    struct genstate *gs=&ifg->gs;
+    char *ptr=buf,*sen;
+    int len;
+
+    if (ifg->tag) {
+        len=sprintf(ptr,"\\s:%.15s,c:%010u,n:%lu",ifa->name,
+                (unsigned) time(NULL),ifg->sent%1000000);
+        len+=sprintf(ptr+len,"*%02X\\",calcsum(ptr+1,len-1));
+        ptr+=len;
+    }
+
+    sen=ptr;
+    len=ifg->mix[ifg->nmix==1?0:gen_rand(gs)%ifg->nmix]->fmt(sen,gs);
+    ptr+=len;
+    ptr+=sprintf(ptr,"*%02X\r\n",calcsum(sen+1,len-1));
+
+    /* Wander about a bit */
+    gs->seq++;
+    gs->cog=fmod(gs->cog+gen_unit(gs)*2-1+360,360);
+    gs->sog=fmax(0,fmin(30,gs->sog+gen_unit(gs)*0.2-0.1));
+    gs->lat+=cos(gs->cog*M_PI/180)*gs->sog*1e-7;
+    gs->lon+=sin(gs->cog*M_PI/180)*gs->sog*1e-7;
+
+    return(ptr-buf);
+}
+
+/*
+ * Advance the time the next sentence is due according to the pattern
+ * Args: generator info
+ * Returns: Nothing
+ */
+static void gen_schedule(struct if_gen *ifg)
+{
+    switch (ifg->pattern) {
+    case GEN_FIXED:
+        ifg->next+=(uint64_t) ifg->interval;
+        break;
+    case GEN_POISSON:
+        ifg->next+=(uint64_t) (-log(1.0-gen_unit(&ifg->gs))*ifg->interval);
+        break;
+    case GEN_BURSTY:
+        /* bursts of back-to-back sentences at the same mean rate */
+        if (ifg->sent % ifg->burst == 0)
+            ifg->next+=(uint64_t) (ifg->interval*ifg->burst);
+        break;
+    }
+}
+
+/*
+ * Fill a buffer with all the sentences which are currently due, sleeping
+ * until at least one is
+ * Args: Interface pointer, buffer (BUFSIZ bytes)
+ * Returns: Number of bytes in the buffer, 0 when count sentences have been
+ * generated
+ * Side effects: ifa->rxstamp set to the time the first sentence was due so
+ * that latency statistics include any lag in generation
+ */
+ssize_t read_generator(iface_t *ifa, char *buf)
+{
+    struct if_gen *ifg = (struct if_gen *) ifa->info;
+    char sbuf[TAGMAX+SENMAX+3];
+    struct timespec ts;
+    uint64_t now;
+    size_t len,n=0;
+
+    if (ifg->count && ifg->sent >= ifg->count)
+        return(0);
+
+    if (ifg->interval) {
+        while ((now=gen_now()) < ifg->next) {
+            ts.tv_sec=(ifg->next-now)/1000000000;
+            ts.tv_nsec=(ifg->next-now)%1000000000;
+            nanosleep(&ts,NULL);
+        }
+        ifa->rxstamp=ifg->next/1000;
+    } else
+        now=0;
+
+    do {
+        len=gen_sentence(ifa,ifg,sbuf);
+        memcpy(buf+n,sbuf,len);
+        n+=len;
+        ifg->sent++;
+        if (ifg->interval)
+            gen_schedule(ifg);
+    } while ((ifg->count == 0 || ifg->sent < ifg->count) &&
+            (ifg->interval == 0 || ifg->next <= now) &&
+            BUFSIZ-n >= sizeof(sbuf));
+
+    return(n);
+}
+
+/*
+ * Free generator information for an interface which failed to initialize
+ * Args: generator info
+ * Returns: Nothing
+ */
+static void free_generator(struct if_gen *ifg)
+{
+    if (ifg->mix)
+        free(ifg->mix);
+    free(ifg);
+}
+
+void cleanup_generator(iface_t *ifa)
+{
+    struct if_gen *ifg = (struct if_gen *) ifa->info;
+
+    if (ifg->mix)
+        free(ifg->mix);
+}
+
+iface_t *init_generator(iface_t *ifa)
+{
+    struct if_gen *ifg;
+    struct kopts *opt;
+    double rate=10;
+    char *ep;
+
+    if (ifa->direction == OUT) {
+        logerr(0,"generator interfaces must be \"in\" (the default) only");
+        return(NULL);
+    }
+
+    if (ifa->direction == BOTH)
+        ifa->direction=IN;
+
+    if ((ifg = (struct if_gen *) malloc(sizeof(struct if_gen))) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        return(NULL);
+    }
+
+    memset ((void *)ifg,0,sizeof(struct if_gen));
+    ifg->pattern=GEN_FIXED;
+    ifg->burst=10;
+    ifg->gs.rng=1;
+    ifg->gs.lat=50.8;
+    ifg->gs.lon=-1.1;
+    ifg->gs.sog=6;
+
+    for(opt=ifa->options;opt;opt=opt->next) {
+        if (!strcasecmp(opt->var,"mix")) {
+            if (parse_mix(ifg,opt->val) < 0)
+                break;
+        } else if (!strcasecmp(opt->var,"rate")) {
+            rate=strtod(opt->val,&ep);
+            if (*ep || rate < 0) {
+                logerr(0,"Invalid rate \"%s\"",opt->val);
+                break;
+            }
+        } else if (!strcasecmp(opt->var,"pattern")) {
+            if (!strcasecmp(opt->val,"fixed"))
+                ifg->pattern=GEN_FIXED;
+            else if (!strcasecmp(opt->val,"poisson"))
+                ifg->pattern=GEN_POISSON;
+            else if (!strcasecmp(opt->val,"bursty"))
+                ifg->pattern=GEN_BURSTY;
+            else {
+                logerr(0,"Invalid option \"pattern=%s\"",opt->val);
+                break;
+            }
+        } else if (!strcasecmp(opt->var,"burst")) {
+            if ((ifg->burst=strtoul(opt->val,&ep,10)) == 0 || *ep) {
+                logerr(0,"Invalid burst size \"%s\"",opt->val);
+                break;
+            }
+        } else if (!strcasecmp(opt->var,"count")) {
+            ifg->count=strtoul(opt->val,&ep,10);
+            if (*ep) {
+                logerr(0,"Invalid count \"%s\"",opt->val);
+                break;
+            }
+        } else if (!strcasecmp(opt->var,"tag")) {
+            if (!strcasecmp(opt->val,"yes"))
+                ifg->tag=1;
+            else if (!strcasecmp(opt->val,"no"))
+                ifg->tag=0;
+            else {
+                logerr(0,"Invalid option \"tag=%s\"",opt->val);
+                break;
+            }
+        } else if (!strcasecmp(opt->var,"seed")) {
+            if ((ifg->gs.rng=strtoull(opt->val,&ep,10)) == 0 || *ep) {
+                logerr(0,"Invalid seed \"%s\"",opt->val);
+                break;
+            }
+        } else {
+            logerr(0,"Unknown interface option %s\n",opt->var);
+            break;
+        }
+    }
+
+    if (opt) {
+        /* Bad option */
+        free_generator(ifg);
+        return(NULL);
+    }
+
+    if (ifg->mix == NULL) {
+        if ((ep=strdup(DEFGENMIX)) == NULL) {
+            logerr(errno,"Could not allocate memory");
+            free_generator(ifg);
+            return(NULL);
+        }
+        if (parse_mix(ifg,ep) < 0) {
+            free(ep);
+            free_generator(ifg);
+            return(NULL);
+        }
+        free(ep);
+    }
+
+    if (rate > 0) {
+        ifg->interval=1e9/rate;
+        ifg->next=gen_now();
+    }
+
+    ifa->info = (void *) ifg;
+
+    free_options(ifa->options);
+
+    ifa->read=do_read;
+    ifa->readbuf=read_generator;
+    ifa->cleanup=cleanup_generator;
+
+    DEBUG(3,"%s: generating %s%g sentences/s",ifa->name,
+            (ifg->interval)?"":"unlimited ",rate);
+    return(ifa);
+}
+
+/*
+ * Discard everything queued for output.  Output filters, dedup and
+ * statistics are applied just as for any other output
+ * Args: Interface pointer
+ * Returns: Nothing
+ */
+void write_null(iface_t *ifa)
+{
+    senblk_t *vec[BATCHMAX];
+    struct iovec iov[BATCHIOV];
+    size_t n;
+
+    while ((n = next_senblk_batch(ifa->q,vec,BATCHMAX)) != 0) {
+        (void) senblk_iov(ifa,vec,&n,iov,NULL,0);
+        senblk_free_batch(vec,n,ifa->q);
+    }
+
+    iface_thread_exit(0);
+}
+
+iface_t *init_null(iface_t *ifa)
+{
+    struct kopts *opt;
+    size_t qsize=DEFNULLQSIZE;
+
+    if (ifa->direction == IN) {
+        logerr(0,"null interfaces must be \"out\" (the default) only");
+        return(NULL);
+    }
+
+    if (ifa->direction == BOTH)
+        ifa->direction=OUT;
+
+    for(opt=ifa->options;opt;opt=opt->next) {
+        if (!strcasecmp(opt->var,"qsize")) {
+            if (!(qsize=atoi(opt->val))) {
+                logerr(0,"Invalid queue size specified: %s",opt->val);
+                return(NULL);
+            }
+        } else {
+            logerr(0,"Unknown interface option %s\n",opt->var);
+            return(NULL);
+        }
+    }
+
+    free_options(ifa->options);
+
+    ifa->write=write_null;
+
+    if (init_q(ifa,qsize) < 0) {
+        logerr(0,"Could not create queue");
+        return(NULL);
+    }
+
+    return(ifa);
+}
@@ -100,7 +100,16 @@ iface_t *new_gofree_conn(pthread_t *tid, struct gofree_mfd *mfd, iface_t *ifa)
     newifa->ifilter=addfilter(ifa->ifilter);
     /* Copying ofilter is unnecessary as gofree is input only */
     newifa->checksum=ifa->checksum;
-    newifa->q=ifa->lists->engine->q;
+    newifa->stats=ifa->stats;
+    if (init_input_q(newifa,ifa->lists->engine->q) < 0) {
+        err=errno;
+        close(newift->fd);
+        free_filter(newifa->ifilter);
+        free(newift);
+        free(newifa);
+        errno=err;
+        return(NULL);
+    }
     /* disable SIGUSR1 before launching new thread to avoid it being killed
      * while holding a mutex */
     sigemptyset(&set);
@@ -20,16 +20,26 @@
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <inttypes.h>
+#include <sched.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /* Macro to identify kplex Proprietary sentences */
-#define isprop(sptr) (sptr->data[1] == 'P' && sptr->data[2] == 'K' && sptr->data[3] == 'P' && sptr->data[4] == 'X')
+#define isprop(sptr) (((sptr)->key & ~(KEYINEXACT|0x3f)) == \
+        (SENKEY('P','K','P','X','Q') & ~0x3f))
 
 /* Globals. Sadly. Used in signal handlers so few other simple options */
 pthread_key_t ifkey;    /* Key for Thread local pointer to interface struct */
 pthread_t reaper;       /* tid of thread responsible for reaping */
 int timetodie=0;        /* Set on receipt of SIGTERM or SIGINT */
 time_t graceperiod=3;   /* Grace period for unsent data before shutdown (secs)*/
+int workers=0;          /* Number of event loop workers (0 for none) */
+int engines=1;          /* Number of engine threads */
 int debuglevel=0;                    /* debug off by default */
 
 /* Signal handler for SIGUSR1 used by interface threads.  Note that this is
@@ -56,41 +66,326 @@ int mysleep(time_t sleepytime)
     return (nanosleep(&rqtp,NULL));
 }
 
+/*
+ * Read a coarse monotonic clock, for timeouts measured in seconds
+ * Args: None
+ * Returns: Seconds since some unspecified point
+ * Where available this is the time of the last clock tick as cached by the
+ * kernel, which is much cheaper to read than the current time
+ */
+time_t monotime(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+#endif
+    return(ts.tv_sec);
+}
+
+/*
+ * Read the coarse monotonic clock with sub-second resolution
+ * Args: None
+ * Returns: Microseconds since some unspecified point
+ * Resolution is that of the kernel's clock tick where the coarse clock is
+ * available
+ */
+uint64_t monousecs(void)
+{
+    struct timespec ts;
+
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE,&ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+#endif
+    return((uint64_t) ts.tv_sec*1000000+ts.tv_nsec/1000);
+}
+
+/*
+ * Read the monotonic clock at full resolution
+ * Args: None
+ * Returns: Microseconds since some unspecified point
+ * Used for latency measurement, where the coarse clock's tick is too long
+ */
+uint64_t preciseusecs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return((uint64_t) ts.tv_sec*1000000+ts.tv_nsec/1000);
+}
+
+/*
+ * Ask the kernel to timestamp data received on a socket
+ * Args: socket
+ * Returns: Nothing
+ * Where this isn't supported sentences are timed when they're parsed
+ */
+void rxstamp_on(int fd)
+{
+#ifdef SO_TIMESTAMPNS
+    int on=1;
+
+    if (setsockopt(fd,SOL_SOCKET,SO_TIMESTAMPNS,&on,sizeof(on)) < 0)
+        DEBUG(3,"Could not enable receive timestamps: %s",strerror(errno));
+#endif
+}
+
+/*
+ * Find the kernel's receive timestamp for a message
+ * Args: message header from recvmsg(), pointer to the difference between
+ * the real time and monotonic clocks (usecs), or 0 to have it worked out
+ * Returns: Receive time on the preciseusecs() clock or 0 if there isn't one
+ * Timestamps are on the real time clock so this is only accurate to within
+ * the time taken to read both clocks (or any step in the real time clock
+ * since the difference was worked out)
+ */
+uint64_t rxstamp(struct msghdr *mh, int64_t *off)
+{
+#ifdef SCM_TIMESTAMPNS
+    struct cmsghdr *cm;
+    struct timespec ts;
+    uint64_t rt;
+
+    if (mh->msg_controllen == 0)
+        return(0);
+
+    for (cm=CMSG_FIRSTHDR(mh);cm;cm=CMSG_NXTHDR(mh,cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_TIMESTAMPNS)
+            continue;
+        memcpy(&ts,CMSG_DATA(cm),sizeof(ts));
+        rt=(uint64_t) ts.tv_sec*1000000+ts.tv_nsec/1000;
+        if (*off == 0) {
+            clock_gettime(CLOCK_REALTIME,&ts);
+            *off=(int64_t) ((uint64_t) ts.tv_sec*1000000+ts.tv_nsec/1000-
+                    preciseusecs());
+        }
+        return(rt-*off);
+    }
+#endif
+    return(0);
+}
+
 /* functions */
 
 /*
- * Check an NMEA 0183 checksum
- * Args: pointer to struct senblk
- * Returns: 0 if checksum matches checksum field, -1 otherwise
- *
+ * Find the token bucket for a LIMIT rule
+ * Args: pointer to rate limit, source interface id
+ * Returns: pointer to bucket
+ * Side effects: A per source bucket is claimed for a new source if one is
+ * free.  Sources beyond LIMITSRCS share the rule's own bucket
  */
-int checkcksum (senblk_t *sptr)
+static uint64_t *limit_bucket(struct ratelimit *rl, unsigned int src)
 {
-    int cksm=0;
-    int rcvdcksum=0,i,end;
-    char *ptr;
+    struct lbucket *lb;
+    unsigned int id;
+    int i;
 
-    for(i=0,end=sptr->len-5,ptr=sptr->data+1;*ptr != '*'; ptr++,i++)
-        if (i == end)
+    if (rl->srcs == NULL || src == 0)
+        return(&rl->tat);
+
+    for (i=0,lb=rl->srcs;i<LIMITSRCS;i++,lb++) {
+        if ((id=__atomic_load_n(&lb->id,__ATOMIC_ACQUIRE)) == 0 &&
+                __atomic_compare_exchange_n(&lb->id,&id,src,0,
+                __ATOMIC_ACQ_REL,__ATOMIC_ACQUIRE))
+            return(&lb->tat);
+        if (id == src)
+            return(&lb->tat);
+    }
+    return(&rl->tat);
+}
+
+/*
+ * Apply a filter rule which matched a sentence
+ * Args: pointer to rule, source interface id of sentence
+ * Returns: 0 if the sentence passes, -1 otherwise
+ * Side effects: token taken from the bucket of a LIMIT rule.  A bucket is
+ * the time at which it will be full (tat): a sentence passes if that is no
+ * more than the burst allowance from now, and adds one period to it.  Output
+ * filters can be shared between threads, hence the compare and swap
+ */
+static int rule_action(sf_rule_t *fptr, unsigned int src)
+{
+    struct ratelimit *rl;
+    uint64_t now,tat,ntat,*tb;
+
+    if (fptr->type == ACCEPT) {
+        return(0);
+    }
+    if (fptr->type == DENY) {
+        return(-1);
+    }
+    /* type is limit. Hopefully. */
+    rl=fptr->info.limit;
+    tb=limit_bucket(rl,src);
+    now=monousecs();
+    tat=__atomic_load_n(tb,__ATOMIC_RELAXED);
+    do {
+        if (tat > now + rl->allow)
             return(-1);
-        else
-            cksm ^= *ptr;
+        ntat=((tat > now)?tat:now)+rl->period;
+    } while (!__atomic_compare_exchange_n(tb,&tat,ntat,0,__ATOMIC_RELAXED,
+            __ATOMIC_RELAXED));
+    return(0);
+}
+
+/*
+ * Pack the start of a sentence into a key and classify it
+ * Args: pointer to senblk
+ * Returns: Nothing
+ * Side effects: senblk's key and sclass set
+ */
+void senkey(senblk_t *sptr)
+{
+    const unsigned char *cptr=(const unsigned char *) sptr->data+1;
+    unsigned int key,code,flags;
+    int i;
+
+    if (*sptr->data == '\r') {
+        sptr->key=0;
+        sptr->sclass=SC_TAGONLY;
+        return;
+    }
 
-    for (i=0,++ptr;i<2;i++,ptr++) {
-        if (*ptr>47 && *ptr<58)
-            rcvdcksum+=*ptr-48;
-        else if (*ptr>64 && *ptr<71)
-             rcvdcksum+=*ptr-55;
-        else if (*ptr>96 && *ptr<103)
-            rcvdcksum+=*ptr-87;
-        if (!i)
-            rcvdcksum<<=4;
+    for (i=0,key=flags=0;i<5 && cptr[i] != '\r';i++) {
+        if ((code=KEYCODE(cptr[i])) == KEYOTHER)
+            flags=KEYINEXACT;
+        key=(key<<6)|code;
     }
+    key=(key<<6*(5-i))|flags;
 
-    if (cksm == rcvdcksum)
-        return (0);
+    if (KEYPOS(key,0) == KEYCODE('P'))
+        sptr->sclass=SC_PROP;
+    else if (KEYFMT(key) == KEYFMT(SENKEY('A','I','V','D','M')) ||
+            KEYFMT(key) == KEYFMT(SENKEY('A','I','V','D','O')))
+        sptr->sclass=SC_AIS;
     else
-        return(1);
+        sptr->sclass=SC_NMEA;
+    sptr->key=key;
+}
+
+/*
+ * Set the key and key mask of a filter or failover rule from its match string
+ * Args: pointer to rule
+ * Returns: Nothing
+ */
+static void rulekey(sf_rule_t *rule)
+{
+    int i;
+
+    for (i=0,rule->key=rule->kmask=0;i<5;i++) {
+        rule->key<<=6;
+        rule->kmask<<=6;
+        if (rule->match[i]) {
+            rule->key|=KEYCODE((unsigned char) rule->match[i]);
+            rule->kmask|=0x3f;
+        }
+    }
+}
+
+/*
+ * Compare a rule's match string with a sentence character by character
+ * Args: pointer to rule, pointer to senblk
+ * Returns: 1 if the rule matches, 0 if not
+ * Only needed for sentences with inexact keys
+ */
+static int charmatch(sf_rule_t *rule, senblk_t *sptr)
+{
+    char *cptr;
+    int i;
+
+    for (i=0,cptr=sptr->data+1;i<5 && *cptr != '\r';i++,cptr++)
+        if(rule->match[i] && rule->match[i] != *cptr)
+            break;
+    return(i==5);
+}
+
+/*
+ * Compile a filter's rules into bitmaps for senfilter()
+ * Args: pointer to filter
+ * Returns: 0 on success, -1 on failure to allocate memory
+ * Side effects: filter's index and posmask set.  For each of the 5 codes in a
+ * sentence key there is a bitmap for each possible code value with a bit set
+ * for each rule matching it at that position, either literally or by
+ * wildcard.  ANDing the 5 bitmaps for a sentence gives the rules it matches,
+ * the first being the lowest bit set.  Source qualifiers are checked only for
+ * those rules.
+ */
+int compile_filter(sfilter_t *filter)
+{
+    sf_rule_t *fptr;
+    unsigned int n,i,w,c;
+    uint64_t bit,*row;
+
+    for (n=0,fptr=filter->rules;fptr;fptr=fptr->next,n++);
+
+    filter->nwords=(n+63)/64;
+    if ((filter->index=(sf_rule_t **) malloc(n*sizeof(sf_rule_t *)+1))
+            == NULL)
+        return(-1);
+    if ((filter->posmask=(uint64_t *) calloc(5*64*filter->nwords+1,
+            sizeof(uint64_t))) == NULL) {
+        free(filter->index);
+        filter->index=NULL;
+        return(-1);
+    }
+
+    for (n=0,fptr=filter->rules;fptr;fptr=fptr->next,n++) {
+        rulekey(fptr);
+        filter->index[n]=fptr;
+        w=n/64;
+        bit=(uint64_t) 1 << (n%64);
+        for (i=0;i<5;i++) {
+            row=filter->posmask+i*64*filter->nwords;
+            if (KEYPOS(fptr->kmask,i)) {
+                row[KEYPOS(fptr->key,i)*filter->nwords+w]|=bit;
+                continue;
+            }
+            /* Wildcards match anything but the end of a (short) sentence */
+            for (c=0;c<64;c++)
+                if (c != KEYEND)
+                    row[c*filter->nwords+w]|=bit;
+        }
+    }
+    return(0);
+}
+
+/*
+ * Find the first rule in a filter matching a sentence
+ * Args: senblk, filter (which must have rules), sentence source
+ * Returns: Pointer to matching rule or NULL if there isn't one
+ */
+static sf_rule_t *filter_rule(senblk_t *sptr, sfilter_t *filter,
+        unsigned int src)
+{
+    sf_rule_t *fptr;
+    unsigned int w,nw,key;
+    uint64_t cand;
+    const uint64_t *pm;
+
+    nw=filter->nwords;
+    pm=filter->posmask;
+    key=sptr->key;
+
+    for (w=0;w<nw;w++) {
+        /* KEYEND in the first 5 codes matches nothing, so what follows it
+         * doesn't matter */
+        cand=pm[KEYPOS(key,0)*nw+w] & pm[(64+KEYPOS(key,1))*nw+w] &
+                pm[(128+KEYPOS(key,2))*nw+w] & pm[(192+KEYPOS(key,3))*nw+w] &
+                pm[(256+KEYPOS(key,4))*nw+w];
+        for (;cand;cand&=cand-1) {
+            fptr=filter->index[w*64+__builtin_ctzll(cand)];
+            if ((fptr->src.id) && (fptr->src.id != src))
+                continue;
+            if ((key & KEYINEXACT) && !charmatch(fptr,sptr))
+                continue;
+            return(fptr);
+        }
+    }
+    return(NULL);
 }
 
 /*
@@ -102,50 +397,67 @@ int senfilter(senblk_t *sptr, sfilter_t *filter)
 {
     unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
     sf_rule_t *fptr;
-    char *cptr;
-    int i;
-    time_t tsecs;
-    struct timeval tv;
+    unsigned int src;
 
     /* We shouldn't actually be filtering any NULL packets, but check anyway */
     if (sptr == NULL || filter == NULL || filter->rules == NULL)
         return(0);
 
-    /* inputs should have ensured all sentences ended with \r\n so if we check
-     * for \r here, we only have to check for \r in the for loops, not \n too */
-    if (*sptr->data == '\r')
+    if (sptr->sclass == SC_TAGONLY)
         return(1);
 
-    for (fptr=filter->rules;fptr;fptr=fptr->next) {
-        if ((fptr->src.id) && (fptr->src.id != (sptr->src&mask)))
-            continue;
-        for (i=0,cptr=sptr->data+1;i<5 && *cptr != '\r';i++,cptr++)
-            if(fptr->match[i] && fptr->match[i] != *cptr)
-                break;
-        if (i!=5)
-            continue;
+    src=sptr->src&mask;
+    if ((fptr=filter_rule(sptr,filter,src)) == NULL)
+        return(0);
+    return(rule_action(fptr,src));
+}
 
-        if (fptr->type == ACCEPT) {
-            return(0);
-        }
-        if (fptr->type == DENY) {
-            return(-1);
-        }
-        /* type is limit. Hopefully. */
-        (void) gettimeofday(&tv,NULL);
-        if (tv.tv_sec < fptr->info.limit->timeout)
-            return(-1);
-        if ((tsecs=(tv.tv_sec - fptr->info.limit->timeout)) <
-                fptr->info.limit->last.tv_sec)
-            return(-1);
-        if (tsecs == fptr->info.limit->last.tv_sec &&
-                (tv.tv_usec < fptr->info.limit->last.tv_usec ))
-            return(-1);
-        /* at least timeout since last seen: Update info and pass */
-        memcpy(&fptr->info.limit->last,&tv,sizeof(struct timeval));
+/*
+ * Check whether a sentence passes a filter without applying rate limits
+ * Args: senblk to be filtered, pointer to filter
+ * Returns: 0 if contents of senblk passes filter, -1 otherwise
+ * LIMIT rules which match pass the sentence but take no token.  For
+ * sentences which aren't part of the live flow, such as a snapshot
+ */
+static int senfilter_nolimit(senblk_t *sptr, sfilter_t *filter)
+{
+    unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
+    sf_rule_t *fptr;
+
+    if (sptr == NULL || filter == NULL || filter->rules == NULL)
         return(0);
-    }
-    return(0);
+
+    if (sptr->sclass == SC_TAGONLY)
+        return(1);
+
+    if ((fptr=filter_rule(sptr,filter,sptr->src&mask)) == NULL)
+        return(0);
+    return((fptr->type == DENY)?-1:0);
+}
+
+/*
+ * Find the priority class of a sentence
+ * Args: senblk, array of priority filters (highest first) and its size
+ * Returns: Index of the first filter with a "+" rule matching the sentence,
+ * or the size of the array if none does
+ * Unlike senfilter(), only explicit accept rules count: a sentence matching
+ * no rule is not given priority
+ */
+int senpriority(senblk_t *sptr, sfilter_t **prio, int n)
+{
+    unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
+    sf_rule_t *fptr;
+    int i;
+
+    if (sptr->sclass == SC_TAGONLY)
+        return(n);
+
+    for (i=0;i<n;i++)
+        if (prio[i] && prio[i]->rules &&
+                (fptr=filter_rule(sptr,prio[i],sptr->src&mask)) &&
+                fptr->type == ACCEPT)
+            return(i);
+    return(n);
 }
 
 /*
@@ -186,11 +498,25 @@ void free_filter(sfilter_t *fptr)
     if (fptr->rules)
         for (rptr=fptr->rules;rptr;rptr=trptr) {
             trptr=rptr->next;
-            if (fptr->type == FAILOVER)
+            if (fptr->type == FAILOVER) {
                 free_srclist(rptr->info.source);
+                if (rptr->fosrc)
+                    free(rptr->fosrc);
+            } else if (rptr->type == LIMIT) {
+                if (rptr->info.limit->srcs)
+                    free(rptr->info.limit->srcs);
+                free(rptr->info.limit);
+            }
             free(rptr);
         }
 
+    if (fptr->index)
+        free(fptr->index);
+    if (fptr->posmask)
+        free(fptr->posmask);
+    if (fptr->fomemo)
+        free(fptr->fomemo);
+
     free(fptr);
 }
 
@@ -209,49 +535,236 @@ void link_src_to_rule (struct srclist **list, struct srclist *src)
     *list=src;
 }
 
+/*
+ * Hash a sentence for duplicate detection
+ * Args: pointer to sentence and its length
+ * Returns: 64 bit fingerprint (never 0)
+ */
+static uint64_t senhash(const char *p, size_t n)
+{
+    uint64_t h=n*0x9E3779B97F4A7C15ULL,w;
+
+    for (;n >= sizeof(w);n-=sizeof(w),p+=sizeof(w)) {
+        memcpy(&w,p,sizeof(w));
+        h=(h^w)*0xFF51AFD7ED558CCDULL;
+        h^=h>>32;
+    }
+    if (n) {
+        w=0;
+        memcpy(&w,p,n);
+        h=(h^w)*0xC4CEB9FE1A85EC53ULL;
+    }
+    h^=h>>29;
+    return(h?h:1);
+}
+
+/*
+ * Create a table for suppressing duplicate sentences
+ * Args: time window in microseconds
+ * Returns: pointer to table or NULL on failure
+ */
+struct dedup *new_dedup(uint64_t window)
+{
+    struct dedup *dd;
+
+    if ((dd=(struct dedup *) calloc(1,sizeof(struct dedup))) == NULL)
+        return(NULL);
+    pthread_mutex_init(&dd->lock,NULL);
+    dd->window=window;
+    return(dd);
+}
+
+/*
+ * Free an interface's duplicate suppression table
+ * Args: pointer to interface
+ * Returns: Nothing
+ */
+void free_dedup(iface_t *ifa)
+{
+    if (ifa->dedup == NULL)
+        return;
+    if (ifa->dedup->dups)
+        DEBUG(3,"%s: %lu duplicate sentences suppressed",
+                ifa->name?ifa->name:"(engine)",ifa->dedup->dups);
+    pthread_mutex_destroy(&ifa->dedup->lock);
+    free(ifa->dedup);
+    ifa->dedup=NULL;
+}
+
+/*
+ * Check whether a sentence repeats one seen within the last window
+ * Args: pointer to duplicate suppression table, pointer to senblk
+ * Returns: 1 if the sentence is a repeat, 0 otherwise
+ * Side effects: A new sentence (or one last seen before the window) is
+ * remembered, displacing the oldest in its set of DEDUPWAYS entries.  Repeats
+ * don't extend the window, so a sentence legitimately sent at intervals
+ * longer than the window always passes.  Tables shared by engine threads
+ * are locked
+ */
+int isdup(struct dedup *dd, senblk_t *sptr)
+{
+    uint64_t fp,now;
+    int i,ret=0;
+    struct dedupent *set,*victim;
+
+    if (sptr->sclass == SC_TAGONLY)
+        return(0);
+
+    fp=senhash(sptr->data,sptr->len);
+    if (dd->shared)
+        pthread_mutex_lock(&dd->lock);
+    now=monousecs();
+    set=victim=&dd->ent[fp & (DEDUPSZ-1) & ~(DEDUPWAYS-1)];
+
+    for (i=0;i<DEDUPWAYS;i++) {
+        if (set[i].fp == fp) {
+            if (now - set[i].seen < dd->window) {
+                dd->dups++;
+                ret=1;
+            } else
+                set[i].seen=now;
+            break;
+        }
+        if (set[i].seen < victim->seen)
+            victim=&set[i];
+    }
+    if (i == DEDUPWAYS) {
+        victim->fp=fp;
+        victim->seen=now;
+    }
+    if (dd->shared)
+        pthread_mutex_unlock(&dd->lock);
+    return(ret);
+}
+
+/*
+ * Compile failover rules for isactive()
+ * Args: pointer to failover filter with source names translated to ids
+ * Returns: 0 on success, -1 on failure to allocate memory
+ * Side effects: Each rule's source list copied to an array of sources.  Index
+ * of rules and (empty) table of sentence keys to rules allocated
+ */
+static int compile_failover(sfilter_t *filter)
+{
+    sf_rule_t *rptr;
+    struct srclist *sptr;
+    unsigned int n;
+    time_t now=monotime();
+
+    for (n=0,rptr=filter->rules;rptr;rptr=rptr->next,n++) {
+        for (rptr->nsrc=0,sptr=rptr->info.source;sptr;sptr=sptr->next)
+            rptr->nsrc++;
+        if ((rptr->fosrc=(struct fosrc *) malloc(rptr->nsrc*
+                sizeof(struct fosrc)+1)) == NULL)
+            return(-1);
+        for (rptr->nsrc=0,sptr=rptr->info.source;sptr;sptr=sptr->next) {
+            rptr->fosrc[rptr->nsrc].id=sptr->src.id;
+            rptr->fosrc[rptr->nsrc].failtime=sptr->failtime;
+            rptr->fosrc[rptr->nsrc++].lasttime=now;
+        }
+    }
+
+    if ((filter->index=(sf_rule_t **) malloc(n*sizeof(sf_rule_t *)+1))
+            == NULL)
+        return(-1);
+    for (n=0,rptr=filter->rules;rptr;rptr=rptr->next)
+        filter->index[n++]=rptr;
+
+    if ((filter->fomemo=(uint64_t *) calloc(FOMEMOSZ,sizeof(uint64_t)))
+            == NULL)
+        return(-1);
+    return(0);
+}
+
+/*
+ * Find the failover rule (if any) for a sentence
+ * Args: Pointer to failover filter, pointer to senblk
+ * Returns: Pointer to first matching rule or NULL if none
+ * Side effects: Result remembered against the sentence key.  Entries in the
+ * table are the key in the top 32 bits and 1 + the rule's index (0 for no
+ * rule) in the bottom 32 and are never changed once set, so need no locking.
+ * If the table is too full, rules are searched each time.
+ */
+static sf_rule_t *forule(sfilter_t *filter, senblk_t *sptr)
+{
+    unsigned int key=sptr->key;
+    unsigned int h,i,n;
+    uint64_t ent,*slot=NULL;
+    char *cptr,*mptr;
+    sf_rule_t *rule;
+
+    /* Inexact keys don't identify a sentence, and 0 is an empty slot */
+    if (key && !(key & KEYINEXACT)) {
+        h=(key*0x9E3779B1U)>>16;
+        /* Give up after a few probes */
+        for (i=0;i<8;i++) {
+            slot=&filter->fomemo[(h+i)&(FOMEMOSZ-1)];
+            if ((ent=__atomic_load_n(slot,__ATOMIC_RELAXED)) == 0)
+                break;
+            if ((ent>>32) == key) {
+                n=(unsigned int) ent;
+                return(n?filter->index[n-1]:NULL);
+            }
+            slot=NULL;
+        }
+    }
+
+    for(n=0,rule=filter->rules;rule;rule=rule->next,n++) {
+        if ((key ^ rule->key) & rule->kmask)
+            continue;
+        if (!(key & KEYINEXACT))
+            break;
+        for (i=0,cptr=sptr->data+1,mptr=rule->match;i<5;i++,cptr++,mptr++)
+            if(*mptr && *cptr != *mptr)
+                break;
+        if (i == 5)
+            break;
+    }
+
+    if (slot)
+        __atomic_store_n(slot,((uint64_t) key << 32) | (rule?n+1:0),
+                __ATOMIC_RELAXED);
+    return(rule);
+}
+
 /*
  * Test if a sentence came from a failover input that is active
  * Args: Pointer to filter head, pointer to senblk to be tested
  * Returns: 1 if  senblk should be passed, 0 if not
+ * Engine threads may test sentences against the same rule at once.  Each
+ * only stores the time its own source was last heard from
  */
 int isactive(sfilter_t *filter,senblk_t *sptr)
 {
-    time_t now=time(NULL);
     unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
-    unsigned int src;
-    char *cptr,*mptr;
+    unsigned int src,i;
     sf_rule_t *rule;
-    struct srclist *rptr;
-    time_t last;
-    int i;
+    struct fosrc *fptr;
+    time_t now,last,heard;
 
     if (filter == NULL || sptr == NULL)
         return(1);
 
+    if ((rule=forule(filter,sptr)) == NULL)
+        return(1);
+
     src = sptr->src & mask;
+    now = monotime();
 
-    for(rule=filter->rules;rule;rule=rule->next) {
-        for (i=0,cptr=sptr->data+1,mptr=rule->match;i<5;i++,cptr++,mptr++)
-            if(*mptr && *cptr != *mptr)
-                break;
-        if (i == 5)
-            break;
-    }
-    if (!rule)
-        return(1);
-    for (last=0,rptr=rule->info.source;rptr;rptr=rptr->next) {
-        if (rptr->src.id == src) {
-            rptr->lasttime = now;
-            if (last+rptr->failtime < now)
+    for (last=0,i=0,fptr=rule->fosrc;i<rule->nsrc;i++,fptr++) {
+        if (fptr->id == src) {
+            __atomic_store_n(&fptr->lasttime,now,__ATOMIC_RELAXED);
+            if (last+fptr->failtime < now)
                 return(1);
             else
                 return(0);
         }
-        if (rptr->lasttime > last)
-            last = rptr->lasttime;
+        if ((heard=__atomic_load_n(&fptr->lasttime,__ATOMIC_RELAXED)) > last)
+            last = heard;
     }
     return(0);
 }
+
 /*
  *  Add a failover specification
  *  Args: address of ofilter pointer and pointer to string containing failover
@@ -271,6 +784,8 @@ int addfailover(sfilter_t **head,char *spec)
         return(-1);
     }
     newrule->info.source=NULL;
+    newrule->fosrc=NULL;
+    newrule->nsrc=0;
 
     for (errno=0,cptr=spec,n=0;n<5;spec++,n++,cptr++) {
         if (!*cptr || *cptr== ':') {
@@ -279,6 +794,7 @@ int addfailover(sfilter_t **head,char *spec)
         }
         newrule->match[n] = (*cptr == '*')?0:*cptr;
     }
+    rulekey(newrule);
 
     if (*cptr++ != ':') {
         free(newrule);
@@ -303,257 +819,52 @@ int addfailover(sfilter_t **head,char *spec)
             done++;
 
         if ((src->src.name = strdup(nptr)) == NULL) {
-            logerr(errno,"Failed to allocate memory for string duplication");
-            free(newrule);
-            return(-1);
-        }
-
-        src->lasttime=now;
-        link_src_to_rule(&newrule->info.source,src);
-    }
-    if (done)
-        if (!*head) {
-            if (((*head)=(sfilter_t *)malloc(sizeof(sfilter_t)))) {
-                (*head)->type=FAILOVER;
-                (*head)->refcount=1;
-                pthread_mutex_init(&(*head)->lock,NULL);
-                (*head)->rules=NULL;
-            }
-        }
-        if (*head) {
-            newrule->next=(*head)->rules;
-            (*head)->rules=newrule;
-            return(0);
-    }
-    if (src)
-        free(src);
-    if (newrule->info.source)
-        free_srclist(newrule->info.source);
-    free(newrule);
-    return(-1);
-}
-
-
-/*
- * Exit function used by interface handlers.  Interface objects are cleaned
- * up by the destructor functions of thread local storage
- * Args: exit status (unused)
- * Returns: Nothing
- */
-void iface_thread_exit(int ret)
-{
-    sigset_t set;
-
-    sigemptyset(&set);
-    sigaddset(&set,SIGUSR1);
-    pthread_sigmask(SIG_BLOCK,&set,NULL);
-
-    pthread_exit((void *)&ret);
-}
-
-/*
- *  Initialise an ioqueue
- *  Args: iface_t to add queue to, size of queue (in senblk structures)
- *  Returns: 0 on success, -1 on failure
- */
-int init_q(iface_t *ifa, size_t size)
-{
-    ioqueue_t *newq;
-    senblk_t *sptr;
-    int    i;
-    if ((newq=(ioqueue_t *)malloc(sizeof(ioqueue_t))) == NULL)
-        return(-1);
-    if ((newq->base=(senblk_t *)calloc(size,sizeof(senblk_t))) ==NULL) {
-        free(newq);
-        return(-1);
-    }
-
-    /* "base" always points to the allocated memory so that we can free() it.
-     * All senblks initially allocated to the free list
-     */
-    newq->free=newq->base;
-
-    /* Initiailise senblk queue pointers */
-    for (i=0,sptr=newq->free,--size;i<size;++i,++sptr)
-        sptr->next=sptr+1;
-
-    sptr->next = NULL;
-
-    newq->qhead = newq->qtail = NULL;
-    newq->owner=ifa;
-
-    pthread_mutex_init(&newq->q_mutex,NULL);
-    pthread_cond_init(&newq->freshmeat,NULL);
-
-    newq->active=1;
-    ifa->q=newq;
-    return(0);
-}
-
-/*
- *  Copy information in a senblk structure (data and len only)
- *  Args: pointers to dest and source senblk structures
- *  Returns: pointer to dest senblk
- */
-senblk_t *senblk_copy(senblk_t *dptr,senblk_t *sptr)
-{
-    dptr->len=sptr->len;
-    dptr->src=sptr->src;
-    dptr->next=NULL;
-    return (senblk_t *) memcpy((void *)dptr->data,(const void *)sptr->data,
-            sptr->len);
-}
-
-/*
- * Add an senblk to an ioqueue
- * Args: Pointer to senblk and Pointer to queue it is to be added to
- * Returns: None
- */
-void push_senblk(senblk_t *sptr, ioqueue_t *q)
-{
-    senblk_t *tptr;
-
-    pthread_mutex_lock(&q->q_mutex);
-
-    if (sptr == NULL) {
-        /* NULL senblk pointer is magic "off" switch for a queue */
-        q->active = 0;
-    } else {
-        /* Get a senblk from the queue's free list if possible...*/
-        if (q->free) {
-            tptr=q->free;
-            q->free=q->free->next;
-        } else {
-            /* ...if not steal from the head of the queue, dropping previous
-               contents. */
-            tptr=q->qhead;
-            q->qhead=q->qhead->next;
-            if (q->drops < 0)
-                q->drops++;
-            DEBUG(4,"Dropped senblk q=0x%x",q);
-        }
-    
-        (void) senblk_copy(tptr,sptr);
-    
-        /* If there is anything on the queue already, set it's "next" member
-           to point to the new senblk */
-        if (q->qtail)
-            q->qtail->next=tptr;
-    
-        /* Set tail pointer to the new senblk */
-        q->qtail=tptr;
-    
-        /* queue head needs to point to new senblk if there was nothing
-           previously on the queue */
-        if (q->qhead == NULL)
-            q->qhead=tptr;
-    
-    }
-    pthread_cond_broadcast(&q->freshmeat);
-    pthread_mutex_unlock(&q->q_mutex);
-}
-
-/*
- *  Get the next senblk from the head of a queue
- *  Args: Queue to retrieve from
- *  Returns: Pointer to next senblk on the queue or NULL if the queue is
- *  no longer active
- *  This function blocks until data are available or the queue is shut down
- */
-senblk_t *next_senblk(ioqueue_t *q)
-{
-    senblk_t *tptr;
-
-    pthread_mutex_lock(&q->q_mutex);
-    while ((tptr = q->qhead) == NULL) {
-        /* No data available for reading */
-        if (!q->active) {
-            /* Return NULL if the queue has been shut down */
-            pthread_mutex_unlock(&q->q_mutex);
-            return ((senblk_t *)NULL);
-        }
-        /* Wait until something is available */
-        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
-    }
-
-    /* set qhead to next element (which may be NULL)
-       If the last element in the queue, set the tail pointer to NULL too */
-    if ((q->qhead=tptr->next) == NULL)
-        q->qtail=NULL;
-    pthread_mutex_unlock(&q->q_mutex);
-    return(tptr);
-}
-
-/*
- *  Get the last senblk from a queue, discarding all before it
- *  Args: Queue to retrieve from
- *  Returns: Pointer to last senblk on the queue or NULL if the queue is
- *  no longer active
- *  This function blocks until data are available or the queue is shut down
- */
-senblk_t *last_senblk(ioqueue_t *q)
-{
-    senblk_t *tptr,*nptr;
-
-    pthread_mutex_lock(&q->q_mutex);
-    /* Move all but last senblk on the queue to the free list */
-    if ((tptr=q->qhead) != NULL) {
-        for (nptr=tptr->next;nptr;tptr=nptr,nptr=nptr->next) {
-            tptr->next=q->free;
-            q->free=tptr;
+            logerr(errno,"Failed to allocate memory for string duplication");
+            free(newrule);
+            return(-1);
         }
-        q->qhead=tptr;
-    }
 
-    while ((tptr = q->qhead) == NULL) {
-        /* No data available for reading */
-        if (!q->active) {
-            /* Return NULL if the queue has been shut down */
-            pthread_mutex_unlock(&q->q_mutex);
-            return ((senblk_t *)NULL);
+        src->lasttime=now;
+        link_src_to_rule(&newrule->info.source,src);
+    }
+    if (done)
+        if (!*head) {
+            if (((*head)=(sfilter_t *)calloc(1,sizeof(sfilter_t)))) {
+                (*head)->type=FAILOVER;
+                (*head)->refcount=1;
+                pthread_mutex_init(&(*head)->lock,NULL);
+                (*head)->rules=NULL;
+            }
         }
-        /* Wait until something is available */
-        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
+        if (*head) {
+            newrule->next=(*head)->rules;
+            (*head)->rules=newrule;
+            return(0);
     }
-
-    /* set qhead to next element (which may be NULL)
-       If the last element in the queue, set the tail pointer to NULL too */
-    if ((q->qhead=tptr->next) == NULL)
-        q->qtail=NULL;
-    pthread_mutex_unlock(&q->q_mutex);
-    return(tptr);
+    if (src)
+        free(src);
+    if (newrule->info.source)
+        free_srclist(newrule->info.source);
+    free(newrule);
+    return(-1);
 }
 
-/*
- * Flush a queue, returning anything on it to the free list
- * Args: Queue to be flushed
- * Returns: Nothing
- * Side Effect: Returns anything on the queue to the free list
- */
-void flush_queue(ioqueue_t *q)
-{
-    pthread_mutex_lock(&q->q_mutex);
-    if (q->qhead != NULL) {
-        q->qtail->next = q->free;
-        q->free=q->qhead;
-        q->qhead=q->qtail=NULL;
-    }
-    pthread_mutex_unlock(&q->q_mutex);
-}
 
 /*
- * Return a senblk to a queue's free list
- * Args: pointer to senblk, and pointer to the queue whose free list it is to
- * be added to
+ * Exit function used by interface handlers.  Interface objects are cleaned
+ * up by the destructor functions of thread local storage
+ * Args: exit status (unused)
  * Returns: Nothing
  */
-void senblk_free(senblk_t *sptr, ioqueue_t *q)
+void iface_thread_exit(int ret)
 {
-    pthread_mutex_lock(&q->q_mutex);
-    /* Adding to head of free list is quicker than tail */
-    sptr->next = q->free;
-    q->free=sptr;
-    pthread_mutex_unlock(&q->q_mutex);
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set,SIGUSR1);
+    pthread_sigmask(SIG_BLOCK,&set,NULL);
+
+    pthread_exit((void *)&ret);
 }
 
 iface_t *get_default_global()
@@ -574,6 +885,9 @@ iface_t *get_default_global()
     }
     ifg->flags=0;
     ifg->logto=LOG_DAEMON;
+    ifg->snapage=DEFSNAPAGE;
+    ifg->snap=NULL;
+    ifg->stats=NULL;
     ifp->strict=1;
     ifp->info = (void *)ifg;
 
@@ -608,30 +922,288 @@ int process_prop(senblk_t *sptr, iface_t *eptr)
         return -1;
     }
 
-    sptr->len+=sprintf(sptr->data+sptr->len,"*%02X\r\n",
-            calcsum(sptr->data+1,sptr->len-1));
+    sptr->xsum=calcsum(sptr->data+1,sptr->len-1);
+    sptr->ckstat=0;
+    senkey(sptr);
+    sptr->len+=sprintf(sptr->data+sptr->len,"*%02X\r\n",sptr->xsum);
     sptr->src=0;
     return(0);
 }
 
+/*
+ * Remember the latest sentence of each type from each source
+ * Args: pointer to snapshot, pointer to senblk
+ * Returns: Nothing
+ * Side effects: Reference to the senblk kept, replacing any previous one of
+ * the same type from the same source.  AIS and kplex's own sentences aren't
+ * kept: their key doesn't identify what they are about.  Neither are
+ * sentences with inexact keys.  Once the table is full (or its probe
+ * sequence for a key is) new types aren't remembered.  Called with the
+ * snapshot's lock held
+ */
+static void snap_update(struct snapshot *ss, senblk_t *sptr)
+{
+    unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
+    unsigned int src=sptr->src&mask;
+    unsigned int h,i;
+
+    if (sptr->sclass == SC_AIS || sptr->sclass == SC_TAGONLY ||
+            sptr->key == 0 || (sptr->key & KEYINEXACT) || isprop(sptr))
+        return;
+
+    h=((sptr->key^src)*0x9E3779B1U)>>16;
+    for (i=0;i<16;i++,h++) {
+        h&=SNAPSHOTSZ-1;
+        if (ss->ent[h].sptr == NULL) {
+            ss->ent[h].key=sptr->key;
+            ss->ent[h].src=src;
+            break;
+        }
+        if (ss->ent[h].key == sptr->key && ss->ent[h].src == src) {
+            senblk_free(ss->ent[h].sptr,NULL);
+            break;
+        }
+    }
+    if (i == 16)
+        return;
+    senblk_ref(sptr);
+    ss->ent[h].sptr=sptr;
+    ss->ent[h].when=monotime();
+}
+
+/*
+ * Send the latest sentences of each type to a newly started output
+ * Args: pointer to output interface
+ * Returns: Nothing
+ * Side effects: Sentences no older than the global "snapshotage" are queued
+ * for the interface.  Called by publish_outputs() with the snapshot's lock
+ * held as the interface is published to the engine threads, so that nothing
+ * is missed or sent out of order.  Readers of a broadcast ring can't be sent
+ * anything of their own so get no snapshot
+ */
+static void send_snapshot(iface_t *ifa)
+{
+    struct if_engine *ifg=(struct if_engine *) ifa->lists->engine->info;
+    struct snapshot *ss=ifg->snap;
+    time_t oldest;
+    int i;
+
+    if (ss == NULL || !flag_test(ifa,F_SNAPSHOT) || ifa->q == NULL ||
+            ifa->q->kind == Q_CURSOR)
+        return;
+
+    oldest=monotime()-ifg->snapage;
+    for (i=0;i<SNAPSHOTSZ;i++) {
+        if (ss->ent[i].sptr == NULL || (ifg->snapage &&
+                ss->ent[i].when < oldest))
+            continue;
+        if (ss->ent[i].sptr->src == ifa->id && !flag_test(ifa,F_LOOPBACK))
+            continue;
+        /* Outputs' filters are applied by the engine.  Don't let the
+         * snapshot use up tokens which LIMIT rules share with the live
+         * sentences (and with other outputs using the same filter) */
+        if (senfilter_nolimit(ss->ent[i].sptr,ifa->ofilter))
+            continue;
+        share_senblk(ss->ent[i].sptr,ifa->q);
+    }
+}
+
+/*
+ * Free an array of outputs
+ * Args: pointer to output array
+ * Returns: Nothing
+ */
+static void free_outset(struct outset *os)
+{
+    if (os == NULL)
+        return;
+    free(os->filt);
+    free(os->dynamic);
+    free(os->cache);
+    free(os);
+}
+
+/*
+ * Build an array of outputs for the engine threads from the output list
+ * Args: pointer to iolists
+ * Returns: pointer to array or NULL on failure to allocate memory
+ * Side effects: Outputs sharing a filter (such as the connections to a tcp
+ * server) refer to a single entry in a list of distinct filters.  A route
+ * cache is allocated for each engine thread if there are any filters.
+ * Filters with LIMIT rules are marked "dynamic": whether they pass a
+ * sentence depends on when it arrives, not just what and where it's from
+ */
+static struct outset *new_outset(struct iolists *lists)
+{
+    struct outset *os;
+    iface_t *optr;
+    sf_rule_t *rptr;
+    int f,n;
+
+    for (n=0,optr=lists->outputs;optr;optr=optr->next,n++);
+    if ((os=(struct outset *) calloc(1,sizeof(struct outset)+
+            n*sizeof(struct outent))) == NULL)
+        return(NULL);
+    if ((os->filt=(sfilter_t **) malloc((n+1)*sizeof(sfilter_t *))) == NULL) {
+        free(os);
+        return(NULL);
+    }
+
+    for (optr=lists->outputs;optr;optr=optr->next) {
+        /* Readers of a broadcast ring get their data from it, not
+         * from us */
+        if (optr->q == NULL || optr->q->kind == Q_CURSOR)
+            continue;
+        os->ent[os->n].q=optr->q;
+        os->ent[os->n].id=optr->id;
+        os->ent[os->n].loopback=flag_test(optr,F_LOOPBACK)?1:0;
+        os->ent[os->n].stats=optr->stats;
+        os->ent[os->n].filt=-1;
+        if (optr->ofilter && optr->ofilter->rules) {
+            for (f=0;f<os->nfilt && os->filt[f] != optr->ofilter;f++);
+            if (f == os->nfilt)
+                os->filt[os->nfilt++]=optr->ofilter;
+            os->ent[os->n].filt=f;
+        }
+        os->n++;
+    }
+
+    if (os->nfilt == 0)
+        return(os);
+
+    os->rwords=(os->nfilt+63)/64;
+    if ((os->dynamic=(uint64_t *) calloc(os->rwords,sizeof(uint64_t)))
+            == NULL || (os->cache=(uint64_t *) calloc(engines*(ROUTESZ*
+            (1+os->rwords)+os->rwords),sizeof(uint64_t))) == NULL) {
+        free_outset(os);
+        return(NULL);
+    }
+    for (f=0;f<os->nfilt;f++)
+        for (rptr=os->filt[f]->rules;rptr;rptr=rptr->next)
+            if (rptr->type == LIMIT) {
+                os->dynamic[f/64]|=(uint64_t) 1 << (f%64);
+                break;
+            }
+    return(os);
+}
+
+/*
+ * Find which of the outputs' filters pass a sentence
+ * Args: output array, engine thread number, senblk
+ * Returns: Pointer to bitmap of filters (in the order of the array's filt)
+ * passing the sentence
+ * Side effects: The results of filters which depend only on the sentence's
+ * key and source are remembered in the engine thread's route cache.  The
+ * cache belongs to the output array, so is started afresh whenever outputs
+ * come or go.  Sentences with inexact keys (which filters must compare
+ * character by character) aren't cached
+ */
+static const uint64_t *route(struct outset *os, int eng, senblk_t *sptr)
+{
+    unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
+    unsigned int src=sptr->src&mask;
+    size_t stride=1+os->rwords;
+    uint64_t *cache=os->cache+eng*(ROUTESZ*stride+os->rwords);
+    uint64_t *scratch=cache+ROUTESZ*stride;
+    uint64_t tag,*ent,*bits=scratch;
+    int f,hit=0;
+
+    if (sptr->key && !(sptr->key & KEYINEXACT) &&
+            sptr->sclass != SC_TAGONLY) {
+        tag=((uint64_t) sptr->key << 32) | src;
+        ent=cache+(((sptr->key^src)*0x9E3779B1U)>>16 & (ROUTESZ-1))*stride;
+        if (ent[0] == tag)
+            hit=1;
+        else
+            ent[0]=tag;
+        bits=ent+1;
+    }
+
+    for (f=0;f<os->nfilt;f++) {
+        /* Dynamic filters' bits in the cache are just left over from the
+         * last sentence and are always recalculated */
+        if (hit && !(os->dynamic[f/64] & ((uint64_t) 1 << (f%64))))
+            continue;
+        if (senfilter(sptr,os->filt[f]) == 0)
+            bits[f/64]|=(uint64_t) 1 << (f%64);
+        else
+            bits[f/64]&=~((uint64_t) 1 << (f%64));
+    }
+    return(bits);
+}
+
+/*
+ * Publish the output list to the engine threads
+ * Args: pointer to iolists, output just added to the list (to be sent a
+ * snapshot) or NULL
+ * Returns: Nothing
+ * Side effects: The engine threads' array of outputs is replaced with one
+ * built from the output list.  Engine threads read the array without locking,
+ * so we wait until none of them can still be using the old one before
+ * freeing it, after which outputs no longer on the list may be freed too.
+ * Must be called with the io_mutex held after any change to the output list
+ */
+void publish_outputs(struct iolists *lists, iface_t *newout)
+{
+    struct if_engine *ifg=(struct if_engine *) lists->engine->info;
+    struct outset *os,*old;
+    unsigned long e,ep;
+    int i;
+
+    if ((os=new_outset(lists)) == NULL)
+        /* Better that the engine sends to nobody for now than to outputs
+         * which have gone */
+        logerr(errno,"Failed to allocate output list: outputs suspended");
+
+    old=lists->outset;
+    if (newout && os && ifg->snap) {
+        /* Engine threads update the snapshot and fetch the outputs under
+         * the lock, so each sentence is either in what we send or sent to
+         * the new output after it */
+        pthread_mutex_lock(&ifg->snap->lock);
+        send_snapshot(newout);
+        __atomic_store_n(&lists->outset,os,__ATOMIC_RELEASE);
+        pthread_mutex_unlock(&ifg->snap->lock);
+    } else
+        __atomic_store_n(&lists->outset,os,__ATOMIC_RELEASE);
+
+    /* Pairs with the fence in run_engine(): Any engine thread which hasn't
+     * announced an epoch before this one will see the new array */
+    e=__atomic_add_fetch(&lists->epoch,1,__ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (i=0;i<engines;i++)
+        while ((ep=__atomic_load_n(&lists->engepoch[i].epoch,
+                __ATOMIC_ACQUIRE)) && ep < e)
+            sched_yield();
+    free_outset(old);
+}
+
 /*
  * This is the heart of the multiplexer.  All inputs add to the tail of the
  * Engine's queue.  The engine takes from the head of its queue and copies
- * to all outputs on its output list.
- * Args: Pointer to information structure (iface_t, cast to void)
+ * to all outputs on its output list.  With the "engines" option there are
+ * several of these, each with its own share of the inputs
+ * Args: Pointer to engine thread's queue (ioqueue_t, cast to void)
  * Returns: Nothing
  */
 void *run_engine(void *info)
 {
     senblk_t *sptr;
-    iface_t *optr;
-    iface_t *eptr = (iface_t *)info;
-    int retval=0;
+    ioqueue_t *q = (ioqueue_t *)info;
+    iface_t *eptr = q->owner;
+    struct iolists *lists = eptr->lists;
+    struct engepoch *ep = &lists->engepoch[q-q->shards];
+    struct if_engine *ifg=(struct if_engine *) eptr->info;
+    struct snapshot *ss=ifg->snap;
+    struct outset *os;
+    struct outent *e;
+    const uint64_t *pass;
+    int retval=0,i,eng=q-q->shards;
 
     (void) pthread_detach(pthread_self());
 
     for (;;) {
-        sptr = next_senblk(eptr->q);
+        sptr = next_senblk(q);
 
         if (sptr==NULL)
             /* Queue has been marked inactive */
@@ -639,23 +1211,69 @@ void *run_engine(void *info)
 
         if (isprop(sptr)) {
             if (process_prop(sptr,eptr)) {
-                senblk_free(sptr,eptr->q);
+                senblk_free(sptr,q);
                 continue;
             }
         }
 
+        if (eptr->dedup && isdup(eptr->dedup,sptr)) {
+            stat_add(eptr,filtered,1);
+            senblk_free(sptr,q);
+            continue;
+        }
+
         if (isactive(eptr->ofilter,sptr)) {
-            pthread_mutex_lock(&eptr->lists->io_mutex);
-            /* Traverse list of outputs and push a copy of senblk to each */
-            for (optr=eptr->lists->outputs;optr;optr=optr->next) {
-                if ((optr->q) && ((!sptr) ||
-                        ((sptr->src != optr->id) || (flag_test(optr,F_LOOPBACK))))) {
-                    push_senblk(sptr,optr->q);
+            if (eptr->stats) {
+                sptr->etime=preciseusecs();
+                if (sptr->itime)
+                    lat_add(&eptr->stats->wait,(sptr->etime > sptr->itime)?
+                            sptr->etime-sptr->itime:0);
+            }
+            /* Announce that we're using the outputs before fetching them
+             * so that they're not freed underneath us.  See
+             * publish_outputs() */
+            __atomic_store_n(&ep->epoch,__atomic_load_n(&lists->epoch,
+                    __ATOMIC_SEQ_CST),__ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (ss) {
+                pthread_mutex_lock(&ss->lock);
+                snap_update(ss,sptr);
+                os=__atomic_load_n(&lists->outset,__ATOMIC_ACQUIRE);
+                pthread_mutex_unlock(&ss->lock);
+            } else
+                os=__atomic_load_n(&lists->outset,__ATOMIC_ACQUIRE);
+            /* Share senblk with each output whose filter passes it.  Each
+             * distinct filter is only consulted once */
+            pass=(os && os->nfilt)?route(os,eng,sptr):NULL;
+            for (i=0;os && i<os->n;i++) {
+                e=&os->ent[i];
+                if (sptr->src == e->id && !e->loopback)
+                    continue;
+                if (e->filt >= 0 &&
+                        !(pass[e->filt/64] & ((uint64_t) 1 << (e->filt%64)))) {
+                    if (e->stats)
+                        __atomic_fetch_add(&e->stats->filtered,1,
+                                __ATOMIC_RELAXED);
+                    continue;
                 }
+                share_senblk(sptr,e->q);
             }
-            pthread_mutex_unlock(&eptr->lists->io_mutex);
-        }
-        senblk_free(sptr,eptr->q);
+            __atomic_store_n(&ep->epoch,0,__ATOMIC_RELEASE);
+        } else
+            stat_add(eptr,filtered,1);
+        senblk_free(sptr,q);
+    }
+
+    /* The last engine thread out gets rid of the snapshot */
+    if (__atomic_sub_fetch(&ifg->running,1,__ATOMIC_ACQ_REL) == 0 && ss) {
+        pthread_mutex_lock(&eptr->lists->io_mutex);
+        for (i=0;i<SNAPSHOTSZ;i++)
+            if (ss->ent[i].sptr)
+                senblk_free(ss->ent[i].sptr,NULL);
+        ifg->snap=NULL;
+        pthread_mutex_unlock(&eptr->lists->io_mutex);
+        pthread_mutex_destroy(&ss->lock);
+        free(ss);
     }
     pthread_exit(&retval);
 }
@@ -706,6 +1324,8 @@ void start_interface(void *ptr)
     else
         ifa->next=NULL;
     (*lptr)=ifa;
+    if (ifa->direction != IN)
+        publish_outputs(ifa->lists,ifa);
 
     if (ifa->lists->initialized == NULL)
         pthread_cond_broadcast(&ifa->lists->init_cond);
@@ -750,14 +1370,17 @@ int link_to_initialized(iface_t *ifa)
  */
 void free_if_data(iface_t *ifa)
 {
-    if ((ifa->direction == OUT) && ifa->q) {
-        /* output interfaces have queues which need freeing */
-        free(ifa->q->base);
-        free(ifa->q);
-    }
+    int i;
+
+    /* An input's queue is left for the engine to free once it's empty */
+    if (ifa->q)
+        free_q(ifa->q);
 
     free_filter(ifa->ifilter);
     free_filter(ifa->ofilter);
+    for (i=0;i<MAXPRIO;i++)
+        free_filter(ifa->priority[i]);
+    free_dedup(ifa);
 
     if (ifa->info) {
         if (ifa->cleanup)
@@ -768,10 +1391,7 @@ void free_if_data(iface_t *ifa)
     if (ifa->pair) {
         ifa->pair->pair=NULL;
         if (ifa->pair->direction == OUT) {
-            pthread_mutex_lock(&ifa->pair->q->q_mutex);
-            ifa->pair->q->active=0;
-            pthread_cond_broadcast(&ifa->pair->q->freshmeat);
-            pthread_mutex_unlock(&ifa->pair->q->q_mutex);
+            push_senblk(NULL,ifa->pair->q);
         } else {
             if (ifa->pair->tid)
                 pthread_kill(ifa->pair->tid,SIGUSR1);
@@ -809,6 +1429,10 @@ int unlink_interface(iface_t *ifa)
             for (tptr=(*lptr);tptr->next != ifa;tptr=tptr->next);
             tptr->next = ifa->next;
         }
+        /* Make sure the engine threads are done with an output before it's
+         * freed */
+        if (ifa->direction != IN)
+            publish_outputs(ifa->lists,NULL);
     
         if (ifa->direction != OUT)
             if (!ifa->lists->inputs) {
@@ -816,10 +1440,7 @@ int unlink_interface(iface_t *ifa)
                     if (tptr->direction == BOTH)
                         break;
                 if (tptr == NULL) {
-                    pthread_mutex_lock(&ifa->lists->engine->q->q_mutex);
-                    ifa->lists->engine->q->active=0;
-                    pthread_cond_broadcast(&ifa->lists->engine->q->freshmeat);
-                    pthread_mutex_unlock(&ifa->lists->engine->q->q_mutex);
+                    push_senblk(NULL,ifa->lists->engine->q);
                     if (timetodie == 0)
                         timetodie++;
                 }
@@ -839,6 +1460,20 @@ int unlink_interface(iface_t *ifa)
     return(0);
 }
 
+/*
+ * Tell an interface to shut down
+ * Args: Pointer to interface structure
+ * Returns: Nothing
+ * io_mutex should be held
+ */
+void kill_interface(iface_t *ifa)
+{
+    if (flag_test(ifa,F_EVLOOP))
+        ev_kill(ifa);
+    else
+        pthread_kill(ifa->tid,SIGUSR1);
+}
+
 /*
  * Cleanup routine for interfaces, used as destructor for pointer to interface
  * structure in the handler thread's local storage
@@ -893,9 +1528,13 @@ sfilter_t *addfilter(sfilter_t *filter)
 iface_t *ifdup (iface_t *ifa)
 {
     iface_t *newif;
+    int i;
 
     if ((newif=(iface_t *) malloc(sizeof(iface_t))) == (iface_t *) NULL)
         return(NULL);
+    /* The duplicate is always made the input half of the pair, and inputs
+     * don't suppress duplicates */
+    newif->dedup=NULL;
     if (iftypes[ifa->type].ifdup_func) {
         if ((newif->info=(*iftypes[ifa->type].ifdup_func)(ifa->info)) == NULL) {
             free(newif);
@@ -920,6 +1559,10 @@ iface_t *ifdup (iface_t *ifa)
     newif->options=NULL;
     newif->ifilter=addfilter(ifa->ifilter);
     newif->ofilter=addfilter(ifa->ofilter);
+    newif->stats=ifa->stats;
+    newif->rxstamp=0;
+    for (i=0;i<MAXPRIO;i++)
+        newif->priority[i]=addfilter(ifa->priority[i]);
     newif->checksum=ifa->checksum;
     newif->strict=ifa->strict;
     return(newif);
@@ -1037,13 +1680,14 @@ int name2id(sfilter_t *filter)
             free(sptr->src.name);
             sptr->src.id=id;
         }
-    return(0);
+    return(compile_failover(filter));
 }
 
 int proc_engine_options(iface_t *e_info,struct kopts *options)
 {
     struct kopts *optr;
     size_t qsize=DEFQUEUESZ;
+    uint64_t window;
     struct if_engine *ifg = (struct if_engine *) e_info->info;
 
     if (e_info->options) {
@@ -1077,6 +1721,16 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
                 fprintf(stderr,"Bad value for graceperiod: %s\n",optr->val);
                 exit(1);
             }
+        } else if (!strcasecmp(optr->var,"engines")) {
+            if ((engines=atoi(optr->val)) < 1) {
+                fprintf(stderr,"Bad value for engines: %s\n",optr->val);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"workers")) {
+            if ((workers=atoi(optr->val)) < 0) {
+                fprintf(stderr,"Bad value for workers: %s\n",optr->val);
+                exit(1);
+            }
         } else if (!strcasecmp(optr->var,"checksum")) {
             if (!strcasecmp(optr->val,"yes"))
                 e_info->checksum=1;
@@ -1100,6 +1754,34 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
                 fprintf(stderr,"Failed to add failover %s\n",optr->val);
                 exit(1);
             }
+        } else if (!strcasecmp(optr->var,"snapshotage")) {
+            errno=0;
+            if (((ifg->snapage=(time_t) strtoumax(optr->val,NULL,0)) == 0) &&
+                    (errno)) {
+                fprintf(stderr,"Bad value for snapshotage: %s\n",optr->val);
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"stats")) {
+            if (ifg->stats)
+                free(ifg->stats);
+            if (!strcasecmp(optr->val,"no"))
+                ifg->stats=NULL;
+            else if ((ifg->stats=strdup(optr->val)) == NULL) {
+                perror("failed to allocate memory");
+                exit(1);
+            }
+        } else if (!strcasecmp(optr->var,"dedup")) {
+            free_dedup(e_info);
+            if (strcasecmp(optr->val,"no")) {
+                if (*getusecs(optr->val,&window) || window == 0) {
+                    fprintf(stderr,"Invalid dedup window: %s\n",optr->val);
+                    exit(1);
+                }
+                if ((e_info->dedup=new_dedup(window)) == NULL) {
+                    perror("failed to allocate duplicate table");
+                    exit(1);
+                }
+            }
         } else {
             fprintf(stderr,"Warning: Unrecognized option \'%s\'\n",optr->var);
             exit(0);
@@ -1110,6 +1792,9 @@ int proc_engine_options(iface_t *e_info,struct kopts *options)
         perror("failed to initiate queue");
         exit(1);
     }
+    if (e_info->dedup)
+        e_info->dedup->shared=(engines > 1);
+    ifg->running=engines;
     return(0);
 }
 
@@ -1167,32 +1852,302 @@ size_t gettag(iface_t *ifa, char *buf, senblk_t *sptr)
     return(len);
 }
 
-/* generic read routine for NMEA data
- * Args: Interface Pointer
- * Returns: nothing
- */ 
-void do_read(iface_t *ifa)
+/*
+ * Build the iovecs needed to write out a batch of senblks, freeing any which
+ * are duplicates.  Output filters have already been applied by the engine
+ * Args: Interface pointer, array of senblks, pointer to number of senblks in
+ * the array, iovec array (BATCHIOV entries), buffer for tags (TAGMAX bytes
+ * per senblk) or NULL, flag indicating CRLF should be written as LF
+ * Returns: Number of iovecs used for each senblk
+ * Side effects: Duplicate senblks are freed and removed from the array and
+ * the number of senblks updated.  Tag output is disabled if a tag can't be
+ * generated
+ */
+int senblk_iov(iface_t *ifa, senblk_t **vec, size_t *n, struct iovec *iov,
+        char *tbuf, int nocr)
 {
-    senblk_t sblk;
-    char buf[BUFSIZ];
-    char tbuf[TAGMAX];
-    char *bptr,*eptr,*ptr;
-    int nread,countmax,count=0;
-    enum sstate senstate;
+    static char lf[] = "\n";
+    int stride=1+(tbuf?1:0)+(nocr?1:0);
+    size_t i,j,bytes=0;
+
+    for (i=j=0;i<*n;i++) {
+        if (ifa->dedup && isdup(ifa->dedup,vec[i])) {
+            senblk_free(vec[i],ifa->q);
+            continue;
+        }
+        bytes+=vec[i]->len;
+        vec[j]=vec[i];
+        if (tbuf) {
+            /* Tags may have been disabled since the caller allocated tbuf,
+             * but the number of iovecs per senblk stays the same */
+            iov->iov_base=tbuf+j*TAGMAX;
+            iov->iov_len=0;
+            if (ifa->tagflags &&
+                    (iov->iov_len=gettag(ifa,iov->iov_base,vec[j])) == 0) {
+                logerr(errno,"Disabing tag output on interface id %x (%s)",
+                        ifa->id,ifa->name);
+                ifa->tagflags=0;
+            }
+            iov++;
+        }
+        iov->iov_base=vec[j]->data;
+        if (nocr) {
+            (iov++)->iov_len=vec[j]->len-2;
+            iov->iov_base=lf;
+            iov->iov_len=1;
+        } else
+            iov->iov_len=vec[j]->len;
+        iov++;
+        j++;
+    }
+    if (ifa->stats) {
+        stat_add(ifa,filtered,*n-j);
+        stat_add(ifa,outsens,j);
+        stat_add(ifa,outbytes,bytes);
+        stat_latency(ifa,vec,j);
+    }
+    *n=j;
+    return(stride);
+}
+
+/*
+ * Write out an array of iovecs in full
+ * Args: file descriptor, iovec array, number of iovecs
+ * Returns: 0 on success, -1 on error
+ * Side effects: iovecs are modified to track partial writes
+ */
+int writev_all(int fd, struct iovec *iov, int cnt)
+{
+    ssize_t n;
+
+    while (cnt) {
+        if ((n=writev(fd,iov,cnt)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return(-1);
+        }
+        for (;cnt && n >= (ssize_t) iov->iov_len;cnt--,iov++)
+            n-=iov->iov_len;
+        if (cnt) {
+            iov->iov_base=(char *) iov->iov_base+n;
+            iov->iov_len-=n;
+        }
+    }
+    return(0);
+}
+
+/* Characters which change sentence framing state (1) or mark the start of
+ * the checksum field (2).  See parse_buf() */
+static const char framechars[256] = {
+    ['\0']=1, ['\n']=1, ['\r']=1, ['!']=1, ['$']=1, ['\\']=1, ['*']=2
+};
+
+/* Values of hex digits.  Anything else counts as 0 */
+static const unsigned char hexval[256] = {
+    ['0']=0, ['1']=1, ['2']=2, ['3']=3, ['4']=4, ['5']=5, ['6']=6, ['7']=7,
+    ['8']=8, ['9']=9, ['A']=10, ['B']=11, ['C']=12, ['D']=13, ['E']=14,
+    ['F']=15, ['a']=10, ['b']=11, ['c']=12, ['d']=13, ['e']=14, ['f']=15
+};
+
+/*
+ * XOR together a run of characters
+ * Args: pointer to characters and how many
+ * Returns: XOR of all characters
+ * Works a word at a time: XOR is the same whichever lane a byte falls in
+ */
+static inline unsigned char xorsum(const char *p, size_t n)
+{
+    uint64_t w=0,t;
+    unsigned char x;
+
+    for (;n >= sizeof(w);n-=sizeof(w),p+=sizeof(w)) {
+        memcpy(&t,p,sizeof(t));
+        w^=t;
+    }
+    w^=w>>32;
+    w^=w>>16;
+    w^=w>>8;
+    for (x=(unsigned char) w;n;n--)
+        x^=*p++;
+    return(x);
+}
+
+/*
+ * Check an NMEA 0183 checksum using state gathered while framing
+ * Args: pointer to struct senblk, offset of first '*' in it (0 if none) and
+ * XOR of characters between the start of the sentence and the '*'
+ * Returns: 0 if checksum matches checksum field, 1 if it does not, -1 if there
+ * is no checksum field
+ */
+static inline int cksum_status(senblk_t *sptr, int star, unsigned char xsum)
+{
+    int rcvd;
+
+    /* Need '*' and (what should be) two hex digits before the line end.  A
+     * bare "$*" is treated as checksum 0 with the line end as its digits, as
+     * it always has been */
+    if (star == 0 || (star > (int) sptr->len-4 && !(sptr->len == 4 && star == 1)))
+        return(-1);
+
+    rcvd=(hexval[(unsigned char) sptr->data[star+1]]<<4) +
+            hexval[(unsigned char) sptr->data[star+2]];
+
+    /* Characters with the top bit set aren't valid NMEA and have always
+     * failed the checksum where an odd number are present */
+    return((xsum < 0x80 && xsum == rcvd)?0:1);
+}
+
+/*
+ * Find the next character of significance to the sentence framer
+ * Args: start and end of buffer
+ * Returns: Pointer to the first of '$', '!', '\\', '\r', '\n', '\0' or '*' in
+ * the buffer or end if there are none
+ * Searches 32 (AVX2) or 16 (SSE2, NEON) bytes at a time where available
+ */
+static inline char *find_framechar(char *p, char *end)
+{
+#if defined(__AVX2__)
+    __m256i v,m;
+    unsigned int mask32;
+
+    for (;end-p >= 32;p+=32) {
+        v=_mm256_loadu_si256((const __m256i *) p);
+        m=_mm256_or_si256(
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,_mm256_set1_epi8('$')),
+                _mm256_cmpeq_epi8(v,_mm256_set1_epi8('!'))),
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,_mm256_set1_epi8('\\')),
+                _mm256_cmpeq_epi8(v,_mm256_set1_epi8('\r'))));
+        m=_mm256_or_si256(m,
+                _mm256_or_si256(_mm256_cmpeq_epi8(v,_mm256_set1_epi8('\n')),
+                _mm256_cmpeq_epi8(v,_mm256_setzero_si256())));
+        m=_mm256_or_si256(m,_mm256_cmpeq_epi8(v,_mm256_set1_epi8('*')));
+        if ((mask32=(unsigned int) _mm256_movemask_epi8(m)))
+            return(p+__builtin_ctz(mask32));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i v16,m16;
+    unsigned int mask16;
+
+    for (;end-p >= 16;p+=16) {
+        v16=_mm_loadu_si128((const __m128i *) p);
+        m16=_mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(v16,_mm_set1_epi8('$')),
+                _mm_cmpeq_epi8(v16,_mm_set1_epi8('!'))),
+                _mm_or_si128(_mm_cmpeq_epi8(v16,_mm_set1_epi8('\\')),
+                _mm_cmpeq_epi8(v16,_mm_set1_epi8('\r'))));
+        m16=_mm_or_si128(m16,
+                _mm_or_si128(_mm_cmpeq_epi8(v16,_mm_set1_epi8('\n')),
+                _mm_cmpeq_epi8(v16,_mm_setzero_si128())));
+        m16=_mm_or_si128(m16,_mm_cmpeq_epi8(v16,_mm_set1_epi8('*')));
+        if ((mask16=(unsigned int) _mm_movemask_epi8(m16)))
+            return(p+__builtin_ctz(mask16));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t v16,m16;
+    uint64_t mask64;
+
+    for (;end-p >= 16;p+=16) {
+        v16=vld1q_u8((const uint8_t *) p);
+        m16=vorrq_u8(vorrq_u8(vceqq_u8(v16,vdupq_n_u8('$')),
+                vceqq_u8(v16,vdupq_n_u8('!'))),
+                vorrq_u8(vceqq_u8(v16,vdupq_n_u8('\\')),
+                vceqq_u8(v16,vdupq_n_u8('\r'))));
+        m16=vorrq_u8(m16,vorrq_u8(vceqq_u8(v16,vdupq_n_u8('\n')),
+                vceqq_u8(v16,vdupq_n_u8(0))));
+        m16=vorrq_u8(m16,vceqq_u8(v16,vdupq_n_u8('*')));
+        /* No movemask on NEON: narrow to 4 bits per byte */
+        mask64=vget_lane_u64(vreinterpret_u64_u8(
+                vshrn_n_u16(vreinterpretq_u16_u8(m16),4)),0);
+        if (mask64)
+            return(p+(__builtin_ctzll(mask64)>>2));
+    }
+#endif
+    for (;p < end && !framechars[(unsigned char) *p];p++);
+    return(p);
+}
+
+/*
+ * Initialise sentence parsing state for an input
+ * Args: Interface Pointer, pointer to parse state
+ * Returns: Nothing
+ */
+void init_rdstate(iface_t *ifa, struct rdstate *rs)
+{
+    rs->sblk.src=ifa->id;
+    rs->sblk.itime=rs->sblk.etime=0;
+    rs->stamp=0;
+    rs->senstate=SEN_NODATA;
+    rs->ptr=NULL;
+    rs->count=rs->countmax=0;
+    rs->star=0;
+    rs->xsum=0;
+}
+
+/*
+ * Parse a buffer of input data, queueing complete sentences for the engine
+ * Args: Interface Pointer, parse state, buffer and number of bytes in it
+ * Returns: Nothing
+ * Side effects: parse state updated so that a sentence split across
+ * successive buffers is re-assembled
+ */
+void parse_buf(iface_t *ifa, struct rdstate *rs, char *buf, size_t nread)
+{
+    char *bptr,*eptr;
+    char *ptr=rs->ptr;
+    int countmax=rs->countmax,count=rs->count;
+    enum sstate senstate=rs->senstate;
     int nocr=flag_test(ifa,F_NOCR)?1:0;
     int loose = (ifa->strict)?0:1;
-    sblk.src=ifa->id;
-    senstate=SEN_NODATA;
+    int star=rs->star;
+    unsigned char xsum=rs->xsum;
+    int span,room;
+    uint64_t itime=0;
+
+    /* Sentences are timed by the buffer which completes them */
+    if (ifa->stats) {
+        itime=(rs->stamp)?rs->stamp:preciseusecs();
+        rs->stamp=0;
+    }
 
-    while ((nread=(*ifa->readbuf)(ifa,buf)) > 0) {
-       DEBUG(9,"kplex.c Buffer %s nread=%i loose=%i nocr=%i, BUFSIZ=%i",buf, nread, loose, nocr, BUFSIZ);
-       for(bptr=buf,eptr=buf+nread;bptr<eptr;bptr++) {
-         switch (*bptr) {
+    for(bptr=buf,eptr=buf+nread;bptr<eptr;bptr++) {
+        if (framechars[(unsigned char) *bptr] != 1) {
+            /* A run of ordinary characters is either copied to the
+             * sentence or tag being assembled (up to its maximum length) or
+             * discarded in one go.  Runs are broken at '*' so that the
+             * checksum can be accumulated as we go */
+            span=find_framechar(bptr+1,eptr)-bptr;
+            if (senstate == SEN_SENPROC || senstate == SEN_TAGPROC) {
+                if ((room=countmax-count+1) < span) {
+                    if (room < 0)
+                        room=0;
+                } else
+                    room=span;
+                if (senstate == SEN_SENPROC && star == 0) {
+                    if (*bptr == '*')
+                        star=ptr-rs->sblk.data;
+                    else
+                        xsum^=xorsum(bptr,room);
+                }
+                if (room < span)
+                    senstate=SEN_NODATA;
+                memcpy(ptr,bptr,room);
+                ptr+=room;
+                count+=room;
+            } else
+                senstate=SEN_NODATA;
+            bptr+=span-1;
+            continue;
+        }
+
+        switch (*bptr) {
             case '$':
             case '!':
-                ptr=sblk.data;
+                ptr=rs->sblk.data;
                 countmax=SENMAX-(nocr|loose);
                 count=1;
+                star=0;
+                xsum=0;
                 *ptr++=*bptr;
                 senstate=SEN_SENPROC;
                 continue;
@@ -1202,7 +2157,7 @@ void do_read(iface_t *ifa)
                     senstate=SEN_TAGSEEN;
                 } else {
                     senstate=SEN_TAGPROC;
-                    ptr=tbuf;
+                    ptr=rs->tbuf;
                     countmax=TAGMAX-1;
                     *ptr++=*bptr;
                     count=1;
@@ -1215,7 +2170,7 @@ void do_read(iface_t *ifa)
                     if (loose || (nocr && *bptr == '\n')) {
                         *ptr++='\r';
                         *ptr='\n';
-                        sblk.len = count+2;
+                        rs->sblk.len = count+2;
                     } else {
                         if ((!nocr) && *bptr == '\r') {
                             senstate = SEN_CR;
@@ -1232,36 +2187,55 @@ void do_read(iface_t *ifa)
                         continue;
                     }
                     *ptr=*bptr;
-                    sblk.len = ++count;
+                    rs->sblk.len = ++count;
                 } else {
                     senstate = SEN_NODATA;
                     continue;
                 }
-                if (!(ifa->checksum && checkcksum(&sblk) && (sblk.len > 0 )) &&
-                        senfilter(&sblk,ifa->ifilter) == 0) {
-                    push_senblk(&sblk,ifa->q);
+                rs->sblk.xsum=xsum;
+                rs->sblk.ckstat=cksum_status(&rs->sblk,star,xsum);
+                rs->sblk.itime=itime;
+                senkey(&rs->sblk);
+                if (ifa->checksum && rs->sblk.ckstat)
+                    stat_add(ifa,badsum,1);
+                else if (senfilter(&rs->sblk,ifa->ifilter))
+                    stat_add(ifa,filtered,1);
+                else {
+                    push_senblk(&rs->sblk,ifa->q);
+                    stat_add(ifa,insens,1);
+                    stat_add(ifa,inbytes,rs->sblk.len);
                 }
                 senstate=SEN_NODATA;
                 continue;
-            default:
-                break;
             }
+    }
+
+    rs->ptr=ptr;
+    rs->count=count;
+    rs->countmax=countmax;
+    rs->senstate=senstate;
+    rs->star=star;
+    rs->xsum=xsum;
+}
 
-         if (senstate != SEN_SENPROC && senstate != SEN_TAGPROC) {
-             if (senstate != SEN_NODATA )
-                 senstate=SEN_NODATA;
-             continue;
-         }
+/* generic read routine for NMEA data
+ * Args: Interface Pointer
+ * Returns: nothing
+ */ 
+void do_read(iface_t *ifa)
+{
+    struct rdstate rs;
+    char buf[BUFSIZ];
+    int nread;
 
-         if (count++ > countmax) {
-             senstate=SEN_NODATA;
-             continue;
-         }
+    init_rdstate(ifa,&rs);
 
-         *ptr++=*bptr;
-       }
+    while ((nread=(*ifa->readbuf)(ifa,buf)) > 0) {
+       DEBUG(9,"kplex.c Buffer %s nread=%i strict=%i nocr=%i, BUFSIZ=%i",buf,
+               nread, ifa->strict, flag_test(ifa,F_NOCR)?1:0, BUFSIZ);
+        rs.stamp=ifa->rxstamp;
+        parse_buf(ifa,&rs,buf,nread);
     }
-    //DEBUG(9,"kplex.c ptr=%s ", ptr);
     iface_thread_exit(errno);
 }
 
@@ -1317,6 +2291,7 @@ int main(int argc, char ** argv)
     int opt,err=0;
     void *ret;
     struct kopts *options=NULL;
+    struct ifstats *stats=NULL;
     sigset_t set;
     struct iolists lists = {
         /* initialize io_mutex separately below */
@@ -1326,7 +2301,9 @@ int main(int argc, char ** argv)
     .initialized = NULL,
     .outputs = NULL,
     .inputs = NULL,
-    .dead = NULL
+    .dead = NULL,
+    /* An engine's epoch of 0 means it's not using the outputs */
+    .epoch = 1
     };
     struct rlimit lim;
     int gotinputs=0;
@@ -1393,6 +2370,11 @@ int main(int argc, char ** argv)
 
     engine->lists = &lists;
     lists.engine=engine;
+    if ((lists.engepoch=(struct engepoch *) calloc(engines,
+            sizeof(struct engepoch))) == NULL) {
+        perror("failed to allocate engine state");
+        exit(1);
+    }
 
     for (tiptr=&engine->next;optind < argc;optind++) {
         if (!(ifptr=parse_arg(argv[optind]))) {
@@ -1469,6 +2451,16 @@ int main(int argc, char ** argv)
      * are initialised to one IN and one OUT which then need to be linked back
      * into the list
      */
+    if (ifg->stats) {
+        for (i=1,ifptr=engine->next;ifptr && i <= MAXINTERFACES;
+                ifptr=ifptr->next,i++);
+        if ((stats=new_stats(i)) == NULL ||
+                (stats[0].name=strdup("_engine")) == NULL)
+            logterm(errno,"Failed to allocate statistics");
+        stats[0].type=iftypes[GLOBAL].name;
+        engine->stats=stats;
+    }
+
     for (ifptr=engine->next,tiptr=&lists.initialized,i=0;ifptr;ifptr=ifptr2) {
         ifptr2 = ifptr->next;
 
@@ -1483,6 +2475,15 @@ int main(int argc, char ** argv)
         if (insertname(ifptr->name,ifptr->id) < 0)
             logterm(errno,"Failed to associate interface name and id");
 
+        if (stats) {
+            /* Interfaces come and go: the statistics have their own copy of
+             * the name */
+            if ((stats[i].name=strdup(ifptr->name)) == NULL)
+                logterm(errno,"Failed to allocate statistics");
+            stats[i].type=iftypes[ifptr->type].name;
+            ifptr->stats=&stats[i];
+        }
+
         ifptr->lists = &lists;
 
         if ((rptr=(*iftypes[ifptr->type].init_func)(ifptr)) == NULL) {
@@ -1506,8 +2507,12 @@ int main(int argc, char ** argv)
          * interfaces where the initialisation routine has expanded them to an
          * IN/OUT pair.
          */
+            if (ifptr->direction == IN && init_input_q(ifptr,engine->q) < 0)
+                logterm(errno,"Failed to create queue for %s",ifptr->name);
+
+            /* Only outputs (and servers spawning them) suppress duplicates */
             if (ifptr->direction == IN)
-                ifptr->q=engine->q;
+                free_dedup(ifptr);
 
             if (ifptr->checksum <0)
                 ifptr->checksum = engine->checksum;
@@ -1527,6 +2532,16 @@ int main(int argc, char ** argv)
         if (ifptr->ofilter)
             if (name2id(ifptr->ofilter))
                 logterm(errno,"Name to interface translation failed");
+        for (i=0;i<MAXPRIO;i++)
+            if (ifptr->priority[i] && name2id(ifptr->priority[i]))
+                logterm(errno,"Name to interface translation failed");
+        if (flag_test(ifptr,F_SNAPSHOT) && ifptr->direction != IN &&
+                ifg->snap == NULL) {
+            if ((ifg->snap=(struct snapshot *) calloc(1,
+                    sizeof(struct snapshot))) == NULL)
+                logterm(errno,"Failed to allocate snapshot");
+            pthread_mutex_init(&ifg->snap->lock,NULL);
+        }
     }
 
     /* Create the key for thread local storage: in this case for a pointer to
@@ -1567,7 +2582,14 @@ int main(int argc, char ** argv)
     pthread_sigmask(SIG_BLOCK, &set, NULL);
     sigdelset(&set,SIGUSR1);
     signal(SIGPIPE,SIG_IGN);
-    pthread_create(&tid,NULL,run_engine,(void *) engine);
+    for (i=0;i<engines;i++)
+        pthread_create(&tid,NULL,run_engine,(void *) &engine->q[i]);
+
+    if (ifg->stats && init_stats(ifg->stats) < 0)
+        logterm(0,"Failed to start statistics server");
+
+    if (workers && ev_init(workers) < 0)
+        logterm(errno,"Failed to start event loop workers");
 
     pthread_mutex_lock(&lists.io_mutex);
     for (ifptr=lists.initialized;ifptr;ifptr=ifptr->next) {
@@ -1586,10 +2608,7 @@ int main(int argc, char ** argv)
      */
     if (!gotinputs) {
         logerr(0,"No Inputs!");
-        pthread_mutex_lock(&engine->q->q_mutex);
-        engine->q->active=0;
-        pthread_cond_broadcast(&engine->q->freshmeat);
-        pthread_mutex_unlock(&engine->q->q_mutex);
+        push_senblk(NULL,engine->q);
         timetodie++;
     }
 
@@ -1622,11 +2641,11 @@ int main(int argc, char ** argv)
             sigdelset(&set,SIGTERM);
             sigdelset(&set,SIGINT);
             for (ifptr=lists.inputs;ifptr;ifptr=ifptr->next) {
-                pthread_kill(ifptr->tid,SIGUSR1);
+                kill_interface(ifptr);
             }
             for (ifptr=lists.outputs;ifptr;ifptr=ifptr->next) {
                 if (ifptr->q == NULL)
-                    pthread_kill(ifptr->tid,SIGUSR1);
+                    kill_interface(ifptr);
             }
             /* Set up the graceperiod alarm */
             if (graceperiod)
@@ -1639,12 +2658,14 @@ int main(int argc, char ** argv)
                 graceperiod=1;
             for (ifptr=lists.outputs;ifptr;ifptr=ifptr->next) {
                 if (ifptr->q)
-                    pthread_kill(ifptr->tid,SIGUSR1);
+                    kill_interface(ifptr);
             }
         }
         for (ifptr=lists.dead;ifptr;ifptr=lists.dead) {
             lists.dead=ifptr->next;
-            pthread_join(ifptr->tid,&ret);
+            /* Event loop connections don't have a thread of their own */
+            if (!flag_test(ifptr,F_EVLOOP))
+                pthread_join(ifptr->tid,&ret);
             free(ifptr);
         }
     }
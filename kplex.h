@@ -6,6 +6,7 @@
 #ifndef KPLEX_H
 #define KPLEX_H
 #include <sys/types.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -23,6 +24,15 @@
 #define KPLEXHOMECONF ".kplex.conf"
 #endif
 
+/* Clock for timed_senblk_batch() deadlines.  Mac OS X has no
+ * pthread_condattr_setclock() so its condition variables only time against
+ * the real time clock */
+#ifdef __APPLE__
+#define QCLOCK CLOCK_REALTIME
+#else
+#define QCLOCK CLOCK_MONOTONIC
+#endif
+
 #ifndef ACCESSPERMS
 #define ACCESSPERMS (S_IRWXU|S_IRWXG|S_IRWXO)
 #endif
@@ -47,6 +57,38 @@
 #define MAXINTERFACES 65535
 
 #define BUFSIZE 1024
+#define CACHELINE 64
+#define SENPOOLSZ 4096
+#define BATCHMAX 64
+/* Most iovecs needed to write out a batch: tag, sentence and line ending */
+#define BATCHIOV (BATCHMAX*3)
+/* Max sentences the engine takes from one input before moving to the next */
+#define MERGEQUANTUM 8
+/* Default number of datagrams to receive per system call */
+#define DEFRXBATCH 16
+/* Limits on datagram payload when packing sentences.  See parse_pack() */
+#define PACKMIN 256
+#define PACKMAX 65507
+#define PACKMTU (-1)
+/* Sources with their own bucket in a per-source LIMIT rule */
+#define LIMITSRCS 16
+/* Sentences remembered for duplicate suppression (a power of 2) and how many
+ * places each may be stored in.  See isdup() */
+#define DEDUPSZ 4096
+#define DEDUPWAYS 4
+/* Sentence keys remembered for failover lookups (a power of 2) */
+#define FOMEMOSZ 256
+/* Sentence types (key and source) whose routes each engine thread remembers
+ * (a power of 2).  See route() */
+#define ROUTESZ 256
+/* Sentences remembered for new outputs (a power of 2) and default maximum
+ * age (secs) of those sent.  See send_snapshot() in kplex.c */
+#define SNAPSHOTSZ 512
+#define DEFSNAPAGE 60
+/* Priority classes an output queue may have above its default class */
+#define MAXPRIO 3
+/* Buckets in a latency histogram.  See lat_bucket() */
+#define LATBUCKETS 256
 
 /* Iinterface flags */
 #define F_PERSIST 1
@@ -54,10 +96,17 @@
 #define F_LOOPBACK 4
 #define F_OPTIONAL 8
 #define F_NOCR 16
+#define F_EVLOOP 32
+#define F_SNAPSHOT 64
+#define F_CONFLATE 128
+#define F_CONFLATESRC 256
 
 #define flag_test(a,b) (a->flags & b)
 #define flag_set(a,b) (a->flags |= b)
 #define flag_clear(a,b) (a->flags &= ~b)
+/* Add to an interface counter if statistics are being kept */
+#define stat_add(a,c,n) do { if ((a)->stats) __atomic_fetch_add(\
+        &(a)->stats->c,(n),__ATOMIC_RELAXED); } while (0)
 
 /* TAG flags */
 #define TAG_TS 1
@@ -66,6 +115,7 @@
 #define TAG_ISRC 8
 
 extern int debuglevel;
+extern int engines;
 #define DEBUG(level,...) if (debuglevel >= level) logdebug(0, __VA_ARGS__)
 #define DEBUG2(level,...) if (debuglevel >= level) logdebug(errno, __VA_ARGS__)
 
@@ -91,6 +141,8 @@ enum itype {
     GOFREE,
     BCAST,
     MCAST,
+    GENERATOR,
+    NULLIF,
     ST,
     END
 };
@@ -120,29 +172,220 @@ enum udptype {
     UDP_MULTICAST
 };
 
+/* Sentence keys pack the 5 characters after the '$' or '!' into 6 bit codes,
+ * the first character in the most significant bits.  Characters after the end
+ * of a short sentence have code KEYEND.  Characters other than letters and
+ * digits share code KEYOTHER and set KEYINEXACT in the key: such keys only
+ * say which sentences can't match */
+#define KEYEND 0
+#define KEYOTHER 63
+#define KEYINEXACT 0x80000000U
+#define KEYCODE(c) (((c) >= '0' && (c) <= '9')?(c)-'0'+1: \
+        ((c) >= 'A' && (c) <= 'Z')?(c)-'A'+11: \
+        ((c) >= 'a' && (c) <= 'z')?(c)-'a'+37:KEYOTHER)
+#define SENKEY(a,b,c,d,e) ((KEYCODE(a)<<24)|(KEYCODE(b)<<18)| \
+        (KEYCODE(c)<<12)|(KEYCODE(d)<<6)|KEYCODE(e))
+#define KEYPOS(key,i) (((key)>>(24-6*(i)))&0x3f)
+#define KEYFMT(key) ((key)&0x3ffff)     /* formatter only */
+
+/* Sentence classes */
+#define SC_NMEA 0       /* Anything not listed below */
+#define SC_PROP 1       /* Proprietary ($P...) */
+#define SC_AIS 2        /* AIS VDM or VDO */
+#define SC_TAGONLY 3    /* Line end with no sentence (after a tag block) */
+
 struct senblk {
     size_t len;
     unsigned int src;
+    unsigned int refcnt;
     struct senblk *next;
+    unsigned char xsum;     /* XOR of characters between '$'/'!' and '*' */
+    signed char ckstat;     /* 0 checksum good, 1 bad, -1 no checksum field */
+    unsigned char sclass;   /* Sentence class (SC_*) */
+    unsigned int key;       /* Packed talker and formatter. See senkey() */
+    uint64_t itime;         /* preciseusecs() (or the kernel's receive time)
+                             * when read, 0 if not timed */
+    uint64_t etime;         /* preciseusecs() when the engine passed it to
+                             * the outputs, 0 if not timed */
     char data[SENBUFSZ];
 };
 typedef struct senblk senblk_t;
 
 typedef struct iface iface_t;
 
+/* Lock free ring of senblk pointers. See queue.c */
+struct qcell {
+    unsigned long seq;
+    senblk_t *sptr;
+};
+
+struct qring {
+    struct qcell *cells;
+    unsigned long mask;
+    /* Keep producers and consumers off each others' cache lines */
+    char pad0[CACHELINE];
+    unsigned long head;
+    char pad1[CACHELINE];
+    unsigned long tail;
+    char pad2[CACHELINE];
+};
+
+/* Slot in a broadcast ring. See queue.c */
+struct bslot {
+    unsigned long seq;
+    senblk_t sen;
+};
+
+enum qkind {
+    Q_RING,         /* Normal queue */
+    Q_BCAST,        /* Broadcast ring shared by many readers */
+    Q_CURSOR,       /* A reader's position in a broadcast ring */
+    Q_CONFLATE,     /* At most one sentence of each type pending */
+    Q_PRIO,         /* Sentences in priority classes sharing one capacity */
+    Q_MERGE         /* The engine's: merges inputs' queues */
+};
+
+/* Pending sentence in a conflating queue */
+struct cfent {
+    unsigned int key;
+    unsigned int src;       /* Source if conflating by source, otherwise 0 */
+    senblk_t *sptr;
+};
+
+/* Conflating queue.  See queue.c */
+struct conflate {
+    pthread_mutex_t lock;
+    struct cfent *ent;
+    unsigned long mask;
+    unsigned long head;
+    unsigned long tail;
+    int bysrc;
+};
+
+/* Pending sentence in a priority queue */
+struct prioent {
+    senblk_t *sptr;
+    int next;               /* Next in class (or free list), -1 if none */
+};
+
+/* Priority queue: a FIFO for each of an output's priority classes (highest
+ * first, then the default) drawing on one pool of entries.  See queue.c */
+struct prioq {
+    pthread_mutex_t lock;
+    struct prioent *ent;
+    int size;
+    int count;
+    int free;               /* Head of free list */
+    int nclass;
+    int head[MAXPRIO+1];    /* -1 if class empty */
+    int tail[MAXPRIO+1];
+};
+
+/* What a reader does when a broadcast ring laps it */
+enum lapped {
+    LAP_SKIP,       /* Skip to the oldest sentence still in the ring */
+    LAP_DISCONNECT, /* Shut down the reader */
+    LAP_RESYNC      /* Skip to the newest sentence */
+};
+
 struct ioqueue {
     iface_t *owner;
     pthread_mutex_t    q_mutex;
     pthread_cond_t    freshmeat;
     int active;
-    int drops;
-    senblk_t *free;
-    senblk_t *qhead;
-    senblk_t *qtail;
-    senblk_t *base;
+    unsigned long drops;
+    int single;
+    int waiting;
+    int evfd;
+    enum qkind kind;
+    struct qring ring;
+    /* Q_CONFLATE */
+    struct conflate *cf;
+    /* Q_PRIO */
+    struct prioq *pq;
+    /* Q_BCAST */
+    struct bslot *slots;
+    unsigned long bmask;
+    unsigned long btail;
+    int refs;
+    enum lapped lapped;
+    struct ioqueue *sleepers;
+    pthread_mutex_t put_mutex;  /* Serializes writers if not single */
+    /* Q_CURSOR */
+    struct ioqueue *bq;
+    unsigned long cursor;
+    int sleeping;
+    struct ioqueue *sleepnext;
+    /* Input queues (Q_RING feeding a Q_MERGE) */
+    struct ioqueue *mq;     /* The engine queue this one feeds */
+    struct ioqueue *rdynext;
+    int ready;              /* On mq's ready list or being served */
+    struct ifstats *stats;  /* Owner's statistics, which outlive it */
+    /* Q_MERGE */
+    struct ioqueue *rdyhead;    /* Inputs with sentences waiting */
+    struct ioqueue *rdytail;
+    struct ioqueue *cur;    /* Input currently being served */
+    int quota;              /* Sentences left to take from cur */
+    int finished;           /* Engine thread has exited */
+    size_t insize;          /* Size of each input's queue */
+    struct ioqueue *shards; /* All engine queues, one per engine thread */
+    int nshards;
+    unsigned int nextshard; /* Shard the next input's queue goes to */
 };
 typedef struct ioqueue ioqueue_t;
 
+/* Sentence parsing state for an input. See parse_buf() */
+struct rdstate {
+    senblk_t sblk;
+    char tbuf[TAGMAX];
+    char *ptr;
+    int count;
+    int countmax;
+    enum sstate senstate;
+    int star;               /* Offset of first '*' in sentence, 0 if none */
+    unsigned char xsum;     /* Running checksum of sentence up to '*' */
+    uint64_t stamp;         /* Receive time of the next buffer parsed or 0 */
+};
+
+/* A received datagram.  See recv_batch() */
+struct dgram {
+    char *buf;
+    size_t len;
+    struct sockaddr_storage src;
+    socklen_t srclen;
+    uint64_t stamp;         /* Kernel receive time or 0.  See rxstamp() */
+};
+
+/* What the engine needs of an output.  See publish_outputs() */
+struct outent {
+    ioqueue_t *q;
+    unsigned int id;
+    int loopback;
+    int filt;                   /* Index of output filter in outset's filt
+                                 * or -1 if none */
+    struct ifstats *stats;
+};
+
+/* Immutable array of outputs published to the engine threads, with their
+ * distinct output filters.  See route() */
+struct outset {
+    int n;
+    int nfilt;
+    int rwords;                 /* 64 bit words in a bitmap of filters */
+    struct sfilter **filt;
+    uint64_t *dynamic;          /* Filters whose results can't be cached */
+    uint64_t *cache;            /* Route cache and scratch bitmap for each
+                                 * engine thread */
+    struct outent ent[];
+};
+
+/* Epoch an engine thread entered its current traversal of the outputs, 0
+ * if it isn't traversing them */
+struct engepoch {
+    unsigned long epoch;
+    char pad[CACHELINE-sizeof(unsigned long)];
+};
+
 struct iolists {
     pthread_mutex_t io_mutex;
     pthread_mutex_t init_mutex;
@@ -153,6 +396,10 @@ struct iolists {
     struct iface *inputs;
     struct iface *dead;
     struct iface *engine;
+    struct outset *outset;      /* Outputs as seen by the engine threads */
+    unsigned long epoch;        /* Bumped each time outset is replaced.
+                                 * Starts at 1: see struct engepoch */
+    struct engepoch *engepoch;  /* One for each engine thread */
 };
 
 struct kopts {
@@ -171,9 +418,25 @@ struct srclist {
     struct srclist *next;
 };
 
+/* Failover source compiled from a srclist.  See compile_failover() */
+struct fosrc {
+    unsigned int id;
+    time_t failtime;
+    time_t lasttime;        /* monotime() when last heard from */
+};
+
+/* LIMIT rules are token buckets kept as the time at which the bucket will
+ * next be full.  See rule_action() */
+struct lbucket {
+    unsigned int id;        /* Source interface (0 for unused) */
+    uint64_t tat;
+};
+
 struct ratelimit {
-    time_t timeout;
-    struct timeval last;
+    uint64_t period;        /* Microseconds per sentence passed */
+    uint64_t allow;         /* Burst allowance: (burst-1)*period */
+    uint64_t tat;           /* Shared bucket */
+    struct lbucket *srcs;   /* Per source buckets (LIMITSRCS) or NULL */
 };
 
 struct sfilter_rule {
@@ -187,6 +450,10 @@ struct sfilter_rule {
         char *name;
     } src;
     char match[5];
+    unsigned int key;       /* match as a sentence key */
+    unsigned int kmask;     /* bits of key which must match (no wildcards) */
+    struct fosrc *fosrc;    /* Failover sources in failtime order */
+    unsigned int nsrc;      /* Number of failover sources */
     struct sfilter_rule *next;
 };
 
@@ -197,10 +464,60 @@ struct sfilter {
     pthread_mutex_t lock;
     unsigned int refcount;
     sf_rule_t *rules;
+    /* Compiled form of FILTER rules. See compile_filter() */
+    unsigned int nwords;    /* 64 bit words in each rule bitmap */
+    sf_rule_t **index;      /* Rules in order, indexed by bit number */
+    uint64_t *posmask;      /* Bitmaps of rules matching each key code at
+                             * each of the 5 sentence positions */
+    /* Compiled form of FAILOVER rules. See compile_failover() */
+    uint64_t *fomemo;       /* Sentence key to rule lookup table */
 };
 
 typedef struct sfilter sfilter_t;
 
+struct evconn;
+
+/* Latency histogram.  See lat_add() */
+struct lathist {
+    unsigned long sum;      /* Total of all latencies (usecs) */
+    unsigned long max;      /* Largest latency (usecs) */
+    unsigned long n[LATBUCKETS];
+};
+
+/* Counters for an interface and any connections accepted by it.  See
+ * stats.c */
+struct ifstats {
+    char *name;
+    char *type;
+    unsigned long insens;       /* Sentences passed to the engine */
+    unsigned long inbytes;
+    unsigned long outsens;      /* Sentences written */
+    unsigned long outbytes;
+    unsigned long badsum;       /* Sentences dropped for bad checksums */
+    unsigned long filtered;     /* Sentences rejected by filters or dedup */
+    unsigned long drops;        /* Sentences lost from a full queue */
+    unsigned long reconnects;
+    unsigned long backlog;      /* Inputs: sentences waiting for the engine */
+    struct lathist wait;        /* Engine: read to engine.  Outputs: engine
+                                 * to write */
+    struct lathist total;       /* Outputs: read to write */
+};
+
+/* Fingerprint of a recently seen sentence */
+struct dedupent {
+    uint64_t fp;
+    uint64_t seen;
+};
+
+/* Fingerprints of recently seen sentences.  See isdup() */
+struct dedup {
+    pthread_mutex_t lock;   /* Taken if shared */
+    int shared;             /* Used by more than one thread */
+    uint64_t window;        /* Microseconds within which repeats are dropped */
+    unsigned long dups;     /* Sentences dropped */
+    struct dedupent ent[DEDUPSZ];
+};
+
 struct iface {
     pthread_t tid;
     unsigned int id;
@@ -219,10 +536,16 @@ struct iface {
     unsigned int tagflags;
     sfilter_t *ifilter;
     sfilter_t *ofilter;
+    sfilter_t *priority[MAXPRIO];
+    struct dedup *dedup;
+    struct ifstats *stats;      /* NULL if statistics are not kept */
+    uint64_t rxstamp;           /* Kernel receive time of the data last
+                                 * returned by readbuf, 0 if unknown */
     void (*cleanup)(struct iface *);
     void (*read)(struct iface *);
     void (*write)(struct iface *);
     ssize_t (*readbuf)(struct iface *,char *buf);
+    struct evconn *evc;
 };
 
 struct iftypedef {
@@ -239,12 +562,32 @@ struct iftypedef {
 #define K_NOSTDOUT 0x4
 #define K_NOSTDERR 0x8
 
+/* Latest sentence of each type from each source */
+struct snapshot {
+    pthread_mutex_t lock;   /* Serializes engine threads and new outputs */
+    struct {
+        unsigned int key;
+        unsigned int src;
+        time_t when;
+        senblk_t *sptr;
+    } ent[SNAPSHOTSZ];
+};
+
 struct if_engine {
     unsigned flags;
     int logto;
+    time_t snapage;         /* Max age of sentences sent to new outputs */
+    struct snapshot *snap;  /* NULL if no outputs want snapshots */
+    char *stats;            /* Address of the statistics server or NULL */
+    int running;            /* Engine threads yet to exit */
 };
 
 int mysleep(time_t);
+time_t monotime(void);
+uint64_t monousecs(void);
+uint64_t preciseusecs(void);
+void rxstamp_on(int);
+uint64_t rxstamp(struct msghdr *, int64_t *);
 
 iface_t *init_file( iface_t *);
 iface_t *init_serial(iface_t *);
@@ -256,6 +599,8 @@ iface_t *init_tcp(iface_t *);
 iface_t *init_gofree(iface_t *);
 iface_t *init_bcast(iface_t *);
 iface_t *init_mcast(iface_t *);
+iface_t *init_generator(iface_t *);
+iface_t *init_null(iface_t *);
 iface_t *init_seatalk(iface_t *);
 
 void *ifdup_serial(void *);
@@ -270,11 +615,21 @@ void *ifdup_mcast(void *);
 void *ifdup_seatalk(void *);
 
 int init_q(iface_t *, size_t);
+void free_q(ioqueue_t *);
+int init_bcast_q(iface_t *, size_t, enum lapped);
+int init_cursor_q(iface_t *, ioqueue_t *);
+int init_input_q(iface_t *, ioqueue_t *);
 
 senblk_t *next_senblk(ioqueue_t *);
 senblk_t *last_senblk(ioqueue_t *);
+size_t next_senblk_batch(ioqueue_t *, senblk_t **, size_t);
+int timed_senblk_batch(ioqueue_t *, senblk_t **, size_t, struct timespec *);
+size_t poll_senblk_batch(ioqueue_t *, senblk_t **, size_t);
 void push_senblk(senblk_t *, ioqueue_t *);
+void share_senblk(senblk_t *, ioqueue_t *);
+void senblk_ref(senblk_t *);
 void senblk_free(senblk_t *, ioqueue_t *);
+void senblk_free_batch(senblk_t **, size_t, ioqueue_t *);
 void flush_queue(ioqueue_t *);
 int link_interface(iface_t *);
 int unlink_interface(iface_t *);
@@ -299,14 +654,40 @@ void loginfo(char *,...);
 void initlog(int);
 sfilter_t *addfilter(sfilter_t *);
 int senfilter(senblk_t *,sfilter_t *);
-int checkcksum(senblk_t *);
+int senpriority(senblk_t *,sfilter_t **,int);
+int compile_filter(sfilter_t *);
+void senkey(senblk_t *);
+struct dedup *new_dedup(uint64_t);
+void free_dedup(iface_t *);
+int isdup(struct dedup *, senblk_t *);
+void publish_outputs(struct iolists *, iface_t *);
+char *getusecs(char *, uint64_t *);
 unsigned int namelookup(char *);
 char *idlookup(unsigned int);
 int insertname(char *, unsigned int);
 void freenames(void);
 int cmdlineopt(struct kopts **, char *);
 void do_read(iface_t *);
+void init_rdstate(iface_t *, struct rdstate *);
+void parse_buf(iface_t *, struct rdstate *, char *, size_t);
+int ev_init(int);
+int ev_add_conn(iface_t *, iface_t *, int);
+void ev_kill(iface_t *);
+int ev_active(void);
 size_t gettag(iface_t *, char *, senblk_t *);
+int senblk_iov(iface_t *, senblk_t **, size_t *, struct iovec *, char *, int);
+int writev_all(int, struct iovec *, int);
+int send_batch(int, struct msghdr *, int);
+struct dgram *alloc_dgrams(size_t);
+int recv_batch(int, struct dgram *, size_t, int);
+int parse_rxbatch(struct kopts *, iface_t *, size_t *, int *);
+int parse_pack(struct kopts *, iface_t *, long *, int *);
+long mtu_payload(int, char *);
+struct ifstats *new_stats(unsigned int);
+int init_stats(char *);
+void stat_latency(iface_t *, senblk_t **, size_t);
+void lat_add(struct lathist *, uint64_t);
+void write_packed(iface_t *, int, void *, socklen_t, size_t, int);
 
 extern struct iftypedef iftypes[];
 
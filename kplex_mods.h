@@ -15,6 +15,8 @@ struct iftypedef iftypes[] = {
     { GOFREE, "gofree", init_gofree, ifdup_gofree },
     { BCAST, "broadcast", init_bcast, ifdup_bcast },
     { MCAST, "multicast", init_mcast, ifdup_mcast },
+    { GENERATOR, "generator", init_generator, NULL },
+    { NULLIF, "null", init_null, NULL },
     { ST, "seatalk", NULL, NULL },
     { END, NULL, NULL, NULL },
 };
@@ -22,6 +22,10 @@ struct if_mcast {
         struct ip_mreq ipmr;
         struct ipv6_mreq ip6mr;
     } mr;
+    size_t rxbatch;
+    int rxwait;
+    long pack;
+    int maxhold;
 };
 
 /*
@@ -67,60 +71,53 @@ void cleanup_mcast(iface_t *ifa)
 void write_mcast(struct iface *ifa)
 {
     struct if_mcast *ifb;
-    senblk_t *sptr;
-    int data=0;
-    struct msghdr msgh;
-    struct iovec iov[2];
+    senblk_t *vec[BATCHMAX];
+    struct msghdr msgs[BATCHMAX];
+    struct iovec iov[BATCHIOV];
+    size_t n,i;
+    int stride;
+    char *tbuf=NULL;
 
     ifb = (struct if_mcast *) ifa->info;
 
-    msgh.msg_name=(void *)&ifb->maddr;
-    msgh.msg_namelen=ifb->asize;
-    msgh.msg_control=NULL;
-    msgh.msg_controllen=msgh.msg_flags=0;
-    msgh.msg_iov=iov;
-    msgh.msg_iovlen=1;
+    if (ifb->pack) {
+        write_packed(ifa,ifb->fd,&ifb->maddr,ifb->asize,ifb->pack,ifb->maxhold);
+        iface_thread_exit(errno);
+    }
+
+    memset(msgs,0,sizeof(msgs));
+    for (i=0;i<BATCHMAX;i++) {
+        msgs[i].msg_name=(void *)&ifb->maddr;
+        msgs[i].msg_namelen=ifb->asize;
+    }
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*BATCHMAX)) == NULL) {
                 logerr(errno,"Disabing tag output on interface id %u (%s)",
                         ifa->id,(ifa->name)?ifa->name:"unlabelled");
                 ifa->tagflags=0;
-        } else {
-            msgh.msg_iovlen=2;
-            data=1;
         }
     }
 
     for (;;) {
-        if ((sptr = next_senblk(ifa->q)) == NULL)
+        if ((n = next_senblk_batch(ifa->q,vec,BATCHMAX)) == 0)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
+        stride=senblk_iov(ifa,vec,&n,iov,tbuf,0);
+        for (i=0;i<n;i++) {
+            msgs[i].msg_iov=iov+i*stride;
+            msgs[i].msg_iovlen=stride;
         }
 
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %u (%s)",
-                        ifa->id,(ifa->name)?ifa->name:"unlabelled");
-                ifa->tagflags=0;
-                msgh.msg_iovlen=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
-
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
-
-        if (sendmsg(ifb->fd,&msgh,0) < 0)
+        if (n && send_batch(ifb->fd,msgs,n) < 0) {
+            senblk_free_batch(vec,n,ifa->q);
             break;
-        senblk_free(sptr,ifa->q);
+        }
+        senblk_free_batch(vec,n,ifa->q);
     }
 
-    if (ifa->tagflags)
-        free(iov[0].iov_base);
+    if (tbuf)
+        free(tbuf);
 
     iface_thread_exit(errno);
 }
@@ -134,6 +131,37 @@ ssize_t read_mcast(iface_t *ifa, char *buf)
     return recvfrom(ifm->fd,(void *)buf,BUFSIZ,0,(struct sockaddr *) &src,&sz);
 }
 
+/*
+ * Read routine for multicast interfaces, receiving several datagrams per call
+ * Args: Interface Pointer
+ * Returns: nothing
+ */
+void read_mcast_batch(iface_t *ifa)
+{
+    struct if_mcast *ifm = (struct if_mcast *) ifa->info;
+    struct rdstate rs;
+    struct dgram *dg;
+    int i,n;
+
+    if ((dg=alloc_dgrams(ifm->rxbatch)) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        iface_thread_exit(errno);
+    }
+
+    init_rdstate(ifa,&rs);
+    if (ifa->stats)
+        rxstamp_on(ifm->fd);
+
+    while ((n=recv_batch(ifm->fd,dg,ifm->rxbatch,ifm->rxwait)) > 0)
+        for (i=0;i<n;i++) {
+            rs.stamp=dg[i].stamp;
+            parse_buf(ifa,&rs,dg[i].buf,dg[i].len);
+        }
+
+    free(dg);
+    iface_thread_exit(errno);
+}
+
 /* Check whether an address is multicast
  * Args: pointer to struct sockaddr_storage
  * Returns: -1 if address family not INET or INET6
@@ -187,10 +215,17 @@ struct iface *init_mcast(struct iface *ifa)
         return(NULL);
     }
     memset(ifm,0,sizeof(struct if_mcast));
+    ifm->rxbatch=DEFRXBATCH;
 
     ifname=host=service=NULL;
 
     for(opt=ifa->options;opt;opt=opt->next) {
+        if ((err=parse_rxbatch(opt,ifa,&ifm->rxbatch,&ifm->rxwait)) < 0 ||
+                (err == 0 &&
+                (err=parse_pack(opt,ifa,&ifm->pack,&ifm->maxhold)) < 0))
+            return(NULL);
+        else if (err)
+            continue;
         if (!strcasecmp(opt->var,"device"))
             ifname=opt->val;
         else if (!strcasecmp(opt->var,"group"))
@@ -408,6 +443,8 @@ struct iface *init_mcast(struct iface *ifa)
     }
 
     if (ifa->direction != IN) {
+        if (ifm->pack == PACKMTU)
+            ifm->pack=mtu_payload(ifm->maddr.ss_family,ifname);
         /* write queue initialization */
         if (init_q(ifa, qsize) < 0) {
             logerr(errno,"Could not create queue");
@@ -416,7 +453,7 @@ struct iface *init_mcast(struct iface *ifa)
     }
 
     ifa->write=write_mcast;
-    ifa->read=do_read;
+    ifa->read=(ifm->rxbatch > 1)?read_mcast_batch:do_read;
     ifa->readbuf=read_mcast;
     ifa->cleanup=cleanup_mcast;
     ifa->info = (void *) ifm;
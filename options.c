@@ -229,6 +229,79 @@ struct kopts *add_option(char *var, char *val)
     return(vv);
 }
 
+/*
+ * Parse a number of seconds, which may have a fractional part
+ * Args: string, address of result
+ * Returns: pointer to the first character after the number
+ * Side effects: result set to the number of microseconds (0 if there is no
+ * number).  Digits beyond microseconds are ignored
+ */
+char *getusecs(char *str, uint64_t *usecs)
+{
+    uint64_t secs,frac=0;
+    unsigned int scale;
+
+    for (secs=0;*str >= '0' && *str <= '9';str++)
+        secs=secs*10 + *str - '0';
+    if (*str == '.')
+        for (scale=100000,str++;*str >= '0' && *str <= '9';str++,scale/=10)
+            frac+=(*str - '0')*scale;
+    *usecs=secs*1000000+frac;
+    return(str);
+}
+
+/*
+ * Parse the parameters of a LIMIT filter rule: "/" followed by the period in
+ * seconds (which may have a fractional part), optionally "/" and the burst
+ * size, optionally "/each" for separate limits for each source interface
+ * Args: address of pointer to the initial "/", pointer to rate limit
+ * Returns: 0 on success, -1 on error
+ * Side effects: Pointer updated to the first character after the parameters
+ */
+static int getlimit(char **fstring, struct ratelimit *rl)
+{
+    char *cptr;
+    uint64_t burst=1;
+
+    cptr=getusecs(*fstring+1,&rl->period);
+
+    if (*cptr == FILTEROPTDELIM && cptr[1] >= '0' && cptr[1] <= '9') {
+        for (burst=0,cptr++;*cptr >= '0' && *cptr <= '9';cptr++)
+            burst=burst*10 + *cptr - '0';
+        if (burst == 0)
+            return(-1);
+    }
+    rl->allow=(burst-1)*rl->period;
+
+    if (*cptr == FILTEROPTDELIM && !strncasecmp(cptr+1,"each",4)) {
+        if ((rl->srcs=(struct lbucket *) calloc(LIMITSRCS,
+                sizeof(struct lbucket))) == NULL)
+            return(-1);
+        cptr+=5;
+    }
+
+    *fstring=cptr;
+    return(0);
+}
+
+/*
+ * Free a filter rule which getfilter() failed to turn into a filter
+ * Args: pointer to rule
+ * Returns: Nothing
+ * Side effects: Rule, any rate limit and any source name are freed
+ */
+static void free_rule(sf_rule_t *rptr)
+{
+    if (rptr->type == LIMIT) {
+        if (rptr->info.limit->srcs)
+            free(rptr->info.limit->srcs);
+        free(rptr->info.limit);
+    }
+    if (rptr->src.name)
+        free(rptr->src.name);
+    free(rptr);
+}
+
 sfilter_t *getfilter(char *fstring)
 {
     char *sptr;
@@ -252,10 +325,8 @@ sfilter_t *getfilter(char *fstring)
             tfilter->type=DENY;
         else if (*fstring == '~') {
             if ((tfilter->info.limit = (struct ratelimit *)
-                    malloc(sizeof(struct ratelimit))) == NULL) {
-                free(tfilter);
+                    malloc(sizeof(struct ratelimit))) == NULL)
                 break;
-            }
             tfilter->type=LIMIT;
             memset(tfilter->info.limit,0,sizeof(struct ratelimit));
         } else
@@ -285,13 +356,8 @@ sfilter_t *getfilter(char *fstring)
 
         if (*fstring == FILTEROPTDELIM) {
             if (tfilter->type == LIMIT) {
-                while(*++fstring) {
-                    if (*fstring >= '0' && *fstring <= '9') 
-                        tfilter->info.limit->timeout =
-                                tfilter->info.limit->timeout*10 + *fstring - '0';
-                    else
-                        break;
-                }
+                if (getlimit(&fstring,tfilter->info.limit))
+                    break;
             } else {
                 break;
             }
@@ -307,20 +373,23 @@ sfilter_t *getfilter(char *fstring)
             break;
     }
     if (ok) {
-        if ((head=(sfilter_t *)malloc(sizeof(sfilter_t))) != NULL) {
+        if ((head=(sfilter_t *)calloc(1,sizeof(sfilter_t))) != NULL) {
             head->type=FILTER;
             pthread_mutex_init(&head->lock,NULL);
             head->refcount=1;
             head->rules=filter;
-            return(head);
+            if (compile_filter(head) == 0)
+                return(head);
+            free(head);
         }
+        tfilter=NULL;
     }
 
     if (tfilter)
-        free(tfilter);
+        free_rule(tfilter);
     for(;filter;filter=tfilter) {
         tfilter=filter->next;
-        free(filter);
+        free_rule(filter);
     }
     return(NULL);
 }
@@ -328,6 +397,8 @@ sfilter_t *getfilter(char *fstring)
 int add_common_opt(char *var, char *val,iface_t *ifp)
 {
     char *ptr;
+    uint64_t window;
+    int i;
 
     if (!strcasecmp(var,"direction")) {
         if (!strcasecmp(val,"in"))
@@ -347,6 +418,48 @@ int add_common_opt(char *var, char *val,iface_t *ifp)
             free_filter(ifp->ofilter);
         if ((ifp->ofilter=getfilter(val)) == NULL)
         return(-2);
+    } else if (!strcmp(var,"priority")) {
+        if (flag_test(ifp,F_CONFLATE)) {
+            logerr(0,"\"priority\" can't be used with \"conflate\"");
+            return(-2);
+        }
+        /* Each use adds a class below those already given */
+        for (i=0;i<MAXPRIO && ifp->priority[i];i++);
+        if (i == MAXPRIO) {
+            logerr(0,"No more than %d priority classes allowed",MAXPRIO);
+            return(-2);
+        }
+        if ((ifp->priority[i]=getfilter(val)) == NULL)
+            return(-2);
+    } else if (!strcmp(var,"dedup")) {
+        free_dedup(ifp);
+        if (!strcasecmp(val,"no"))
+            return(0);
+        if (*(ptr=getusecs(val,&window)) || ptr == val || window == 0)
+            return(-2);
+        if ((ifp->dedup=new_dedup(window)) == NULL)
+            return(-1);
+    } else if (!strcmp(var,"snapshot")) {
+        if (!strcasecmp(val,"yes")) {
+            flag_set(ifp,F_SNAPSHOT);
+        } else if (!strcasecmp(val,"no")) {
+            flag_clear(ifp,F_SNAPSHOT);
+        } else
+            return(-2);
+    } else if (!strcmp(var,"conflate")) {
+        if (strcasecmp(val,"no") && ifp->priority[0]) {
+            logerr(0,"\"conflate\" can't be used with \"priority\"");
+            return(-2);
+        }
+        if (!strcasecmp(val,"yes")) {
+            flag_set(ifp,F_CONFLATE);
+            flag_clear(ifp,F_CONFLATESRC);
+        } else if (!strcasecmp(val,"source")) {
+            flag_set(ifp,F_CONFLATE|F_CONFLATESRC);
+        } else if (!strcasecmp(val,"no")) {
+            flag_clear(ifp,(F_CONFLATE|F_CONFLATESRC));
+        } else
+            return(-2);
     } else if (!strcmp(var,"strict")) {
         if (!strcasecmp(val,"yes")) {
             ifp->strict=1;
@@ -524,6 +637,9 @@ iface_t *parse_file(char *fname)
             }
             ifg->flags=0;
             ifg->logto=LOG_DAEMON;
+            ifg->snapage=DEFSNAPAGE;
+            ifg->snap=NULL;
+            ifg->stats=NULL;
             ifp->info = (void *)ifg;
             if (ifp->strict <0)
                 ifp->strict = 1;
@@ -594,6 +710,10 @@ iface_t *parse_arg(char *arg)
 */
     else if (!strcasecmp(arg,"gofree"))
         ifp->type = GOFREE;
+    else if (!strcasecmp(arg,"generator"))
+        ifp->type = GENERATOR;
+    else if (!strcasecmp(arg,"null"))
+        ifp->type = NULLIF;
     else {
         fprintf(stderr,"Unrecognised interface type %s\n",arg);
         free(ifp);
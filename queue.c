@@ -0,0 +1,1419 @@
+/* queue.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2016
+ * For copying information see the file COPYING distributed with this software
+ *
+ * This file contains the sentence queues which connect inputs to the
+ * multiplexing engine and the engine to outputs.
+ *
+ * Each queue is a bounded ring of pointers to senblks.  The rings are lock
+ * free: each cell carries a sequence number which tells producers and
+ * consumers whether it is ready for them (after D. Vyukov's bounded MPMC
+ * queue).  Input queues have just one producer, as do output queues if there
+ * is only one engine thread, and then the producer need not contend for the
+ * ring's tail.
+ * A mutex and condition variable are retained only for a consumer to sleep
+ * on when its queue is empty.  Producers only touch them if the consumer has
+ * announced it is actually asleep.
+ *
+ * Each input has its own queue to the engine so that a busy input can't hold
+ * up the others.  The engine's queue (of kind Q_MERGE) has no ring of its
+ * own, just a list of input queues with sentences waiting.  An input puts
+ * its queue on the list when it adds to it while it isn't already there, and
+ * the engine takes up to MERGEQUANTUM sentences from the queue at the head
+ * of the list before moving it to the back if it has more.  An input's queue
+ * outlives the input: the engine frees it once it's empty.
+ *
+ * With the global "engines" option there is more than one engine thread,
+ * each with its own Q_MERGE queue (a "shard").  Each input's queue is given
+ * to a shard when it is created and stays with it, so sentences from one
+ * source are passed to outputs in the order they were read.  Outputs' queues
+ * then have a producer for each engine.
+ *
+ * senblks are reference counted and shared.  Inputs copy sentences into a
+ * senblk from a global pool.  The engine hands the same senblk to every
+ * output queue, bumping its reference count, and the senblk goes back to the
+ * pool when the last output is done with it.  senblks on queues must be
+ * treated as read only.
+ *
+ * A broadcast ring is an alternative for outputs with many readers, such as
+ * the clients of a tcp server.  The engine writes each sentence to the ring
+ * once and each reader has only a cursor (a queue of kind Q_CURSOR) marking
+ * its position.  Slots are protected by sequence numbers in the manner of a
+ * seqlock: a reader copies a sentence out and then checks that the slot
+ * wasn't overwritten while it did so.  A reader which falls more than a ring
+ * behind is "lapped" and handled according to the ring's lapped policy.
+ * Readers take copies rather than references because the engine overwrites
+ * slots in place without knowing who is reading them: a reference would
+ * need the slot's senblk to be kept until every reader had finished with
+ * it, putting back the per-reader work on the engine and a reference count
+ * shared by every reader.  As it is, the engine's cost is the same however
+ * many readers there are, each reader copies at most one sentence per slot
+ * into a senblk only it touches, and the slots themselves are only ever
+ * read by the readers.
+ *
+ * A conflating queue is for slow outputs which would otherwise lose sentences
+ * at random when their queue overflowed.  It holds at most one sentence of
+ * each type (sentence key, optionally qualified by source): a new sentence
+ * replaces any of the same type still waiting, keeping its place in the
+ * queue.  Pending sentences are few and their consumer slow, so a conflating
+ * queue is simply an array under a mutex rather than a lock free ring.
+ *
+ * An output with "priority" filters has a priority queue: a FIFO for each
+ * priority class and one for everything else, all drawing on a single pool
+ * of "qsize" entries.  Readers empty the classes highest first.  When the
+ * pool is exhausted it is the oldest sentence of the lowest class with any
+ * waiting which is dropped, so a burst of low priority sentences can't push
+ * out those of higher classes.  Like a conflating queue, it is small and
+ * kept under a mutex.
+ */
+
+#include "kplex.h"
+#include <sched.h>
+#include <stdint.h>
+
+static size_t q_get(ioqueue_t *, senblk_t **, size_t);
+
+/* Cache of free senblks shared by all queues */
+static struct qring senpool;
+static pthread_once_t senpool_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Initialise a ring of senblk pointers
+ * Args: pointer to ring, minimum number of entries
+ * Returns: 0 on success, -1 on failure
+ * Ring size is rounded up to a power of 2
+ */
+static int ring_init(struct qring *r, size_t size)
+{
+    size_t n,i;
+
+    for (n=1;n<size;n<<=1);
+
+    if ((r->cells=(struct qcell *)malloc(n*sizeof(struct qcell))) == NULL)
+        return(-1);
+
+    for (i=0;i<n;i++) {
+        r->cells[i].seq=i;
+        r->cells[i].sptr=NULL;
+    }
+    r->mask=n-1;
+    r->head=r->tail=0;
+    return(0);
+}
+
+/*
+ * Add a senblk to the tail of a ring
+ * Args: pointer to ring, senblk pointer, flag indicating that the caller is
+ * the only thread which ever adds to this ring
+ * Returns: 0 on success, -1 if the ring is full
+ * A ring is also "full" for the instant between a consumer claiming the cell
+ * we need and releasing it.
+ */
+static int ring_tryput(struct qring *r, senblk_t *sptr, int single)
+{
+    struct qcell *cell;
+    unsigned long pos,seq;
+    long dif;
+
+    pos=__atomic_load_n(&r->tail,__ATOMIC_RELAXED);
+    for (;;) {
+        cell=&r->cells[pos & r->mask];
+        seq=__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE);
+        dif=(long) (seq - pos);
+        if (dif == 0) {
+            if (single) {
+                __atomic_store_n(&r->tail,pos+1,__ATOMIC_RELAXED);
+                break;
+            }
+            if (__atomic_compare_exchange_n(&r->tail,&pos,pos+1,1,
+                    __ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0)
+            return(-1);
+        else
+            pos=__atomic_load_n(&r->tail,__ATOMIC_RELAXED);
+    }
+    cell->sptr=sptr;
+    __atomic_store_n(&cell->seq,pos+1,__ATOMIC_RELEASE);
+    return(0);
+}
+
+/*
+ * Take a senblk from the head of a ring
+ * Args: pointer to ring
+ * Returns: senblk pointer or NULL if the ring is empty
+ */
+static senblk_t *ring_get(struct qring *r)
+{
+    struct qcell *cell;
+    unsigned long pos,seq;
+    senblk_t *sptr;
+    long dif;
+
+    pos=__atomic_load_n(&r->head,__ATOMIC_RELAXED);
+    for (;;) {
+        cell=&r->cells[pos & r->mask];
+        seq=__atomic_load_n(&cell->seq,__ATOMIC_ACQUIRE);
+        dif=(long) (seq - (pos+1));
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&r->head,&pos,pos+1,1,
+                    __ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+        } else if (dif < 0)
+            return(NULL);
+        else
+            pos=__atomic_load_n(&r->head,__ATOMIC_RELAXED);
+    }
+    sptr=cell->sptr;
+    __atomic_store_n(&cell->seq,pos+r->mask+1,__ATOMIC_RELEASE);
+    return(sptr);
+}
+
+/*
+ * Check whether a ring has anything in it
+ * Args: pointer to ring
+ * Returns: non-zero if the ring is not empty
+ * Only a hint unless the caller is the ring's sole consumer and producers are
+ * known to have finished
+ */
+static int ring_busy(struct qring *r)
+{
+    unsigned long pos=__atomic_load_n(&r->head,__ATOMIC_RELAXED);
+
+    return(__atomic_load_n(&r->cells[pos & r->mask].seq,__ATOMIC_ACQUIRE) ==
+            pos+1);
+}
+
+/*
+ *  Copy information in a senblk structure (data and len only)
+ *  Args: pointers to dest and source senblk structures
+ *  Returns: pointer to dest senblk
+ */
+senblk_t *senblk_copy(senblk_t *dptr,senblk_t *sptr)
+{
+    dptr->len=sptr->len;
+    dptr->src=sptr->src;
+    dptr->xsum=sptr->xsum;
+    dptr->ckstat=sptr->ckstat;
+    dptr->sclass=sptr->sclass;
+    dptr->key=sptr->key;
+    dptr->itime=sptr->itime;
+    dptr->etime=sptr->etime;
+    dptr->next=NULL;
+    return (senblk_t *) memcpy((void *)dptr->data,(const void *)sptr->data,
+            sptr->len);
+}
+
+static void senpool_init(void)
+{
+    if (ring_init(&senpool,SENPOOLSZ) < 0)
+        senpool.cells=NULL;
+}
+
+/*
+ * Get a senblk from the global pool
+ * Args: None
+ * Returns: Pointer to a senblk with a reference count of 1, or NULL if no
+ * memory is available
+ */
+static senblk_t *senblk_alloc(void)
+{
+    senblk_t *sptr=NULL;
+
+    (void) pthread_once(&senpool_once,senpool_init);
+
+    if (senpool.cells)
+        sptr=ring_get(&senpool);
+    if (sptr == NULL && (sptr=(senblk_t *) malloc(sizeof(senblk_t))) == NULL)
+        return(NULL);
+
+    sptr->refcnt=1;
+    return(sptr);
+}
+
+/*
+ * Drop a reference to a senblk, returning it to the global pool if that was
+ * the last one
+ * Args: Pointer to senblk
+ * Returns: Nothing
+ */
+static void senblk_release(senblk_t *sptr)
+{
+    if (__atomic_sub_fetch(&sptr->refcnt,1,__ATOMIC_ACQ_REL))
+        return;
+
+    if (senpool.cells == NULL || ring_tryput(&senpool,sptr,0) < 0)
+        free(sptr);
+}
+
+/*
+ * Wake up a queue's consumer
+ * Args: queue
+ * Returns: Nothing
+ * Consumers run by an event loop are woken through the queue's event fd,
+ * others through its condition variable
+ */
+static void q_kick(ioqueue_t *q)
+{
+    uint64_t one=1;
+
+    if (q->evfd >= 0) {
+        (void) write(q->evfd,&one,sizeof(one));
+        return;
+    }
+    /* Cursor readers sleep on their broadcast ring */
+    if (q->kind == Q_CURSOR)
+        q=q->bq;
+    pthread_mutex_lock(&q->q_mutex);
+    pthread_cond_broadcast(&q->freshmeat);
+    pthread_mutex_unlock(&q->q_mutex);
+}
+
+/*
+ * Wake up a queue's consumer, but only if it's asleep
+ * Args: queue
+ * Returns: Nothing
+ */
+static void q_wake(ioqueue_t *q)
+{
+    /* Pairs with the fence in q_wait() and poll_senblk_batch(): Either we
+     * see the consumer waiting or it sees what we've just added to the
+     * queue */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->waiting,__ATOMIC_RELAXED))
+        q_kick(q);
+}
+
+/*
+ * Free an input's queue
+ * Args: input queue
+ * Returns: Nothing
+ * The engine does this once the input has finished with the queue and it's
+ * empty, or the input itself when it finishes if the engine has exited
+ */
+static void input_q_free(ioqueue_t *q)
+{
+    senblk_t *tptr;
+
+    while ((tptr=ring_get(&q->ring)) != NULL)
+        senblk_release(tptr);
+    free(q->ring.cells);
+    free(q);
+}
+
+/*
+ * Add an input's queue to the back of the engine's ready list and wake the
+ * engine if it's asleep
+ * Args: engine queue, input queue
+ * Returns: Nothing
+ * Side effects: If the engine thread has exited the queue is left off the
+ * list, and freed if the input has finished with it
+ */
+static void rdy_append(ioqueue_t *mq, ioqueue_t *q)
+{
+    int finished;
+
+    q->rdynext=NULL;
+    pthread_mutex_lock(&mq->q_mutex);
+    if ((finished=mq->finished))
+        /* Nobody to serve it.  Let the input try again when it closes */
+        __atomic_store_n(&q->ready,0,__ATOMIC_RELAXED);
+    else {
+        if (mq->rdytail)
+            mq->rdytail->rdynext=q;
+        else
+            mq->rdyhead=q;
+        mq->rdytail=q;
+        if (mq->waiting)
+            pthread_cond_signal(&mq->freshmeat);
+    }
+    pthread_mutex_unlock(&mq->q_mutex);
+
+    if (finished && !__atomic_load_n(&q->active,__ATOMIC_ACQUIRE))
+        input_q_free(q);
+}
+
+/*
+ * Make sure the engine knows an input's queue has something for it
+ * Args: input queue
+ * Returns: Nothing
+ * The ready flag is set while a queue is on the ready list or being served
+ * by the engine.  Whoever sets it puts the queue on the list.
+ */
+static void q_ready(ioqueue_t *q)
+{
+    /* Pairs with the fence in merge_get(): Either the engine sees what we've
+     * just added or we see that the queue is no longer ready */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->ready,__ATOMIC_RELAXED) ||
+            __atomic_exchange_n(&q->ready,1,__ATOMIC_ACQ_REL))
+        return;
+    rdy_append(q->mq,q);
+}
+
+/*
+ * Add a senblk to a conflating queue
+ * Args: queue, senblk (whose reference the queue takes over)
+ * Returns: Nothing
+ * Side effects: Any pending senblk of the same type is replaced.  If the
+ * queue is full of other types the oldest is dropped
+ */
+static void cf_put(ioqueue_t *q, senblk_t *sptr)
+{
+    unsigned int mask = (unsigned int) -1 ^ IDMINORMASK;
+    struct conflate *cf=q->cf;
+    struct cfent *e;
+    senblk_t *old=NULL;
+    unsigned int src;
+    unsigned long i;
+
+    src=cf->bysrc?(sptr->src&mask):0;
+    pthread_mutex_lock(&cf->lock);
+    for (i=cf->head;i != cf->tail;i++) {
+        e=&cf->ent[i & cf->mask];
+        if (e->key == sptr->key && e->src == src) {
+            old=e->sptr;
+            e->sptr=sptr;
+            break;
+        }
+    }
+    if (old == NULL) {
+        if (cf->tail - cf->head > cf->mask) {
+            old=cf->ent[cf->head++ & cf->mask].sptr;
+            q->drops++;
+            stat_add(q->owner,drops,1);
+            DEBUG(4,"Dropped senblk q=0x%x",q);
+        }
+        e=&cf->ent[cf->tail++ & cf->mask];
+        e->key=sptr->key;
+        e->src=src;
+        e->sptr=sptr;
+    }
+    pthread_mutex_unlock(&cf->lock);
+
+    if (old)
+        senblk_release(old);
+    q_wake(q);
+}
+
+/*
+ * Take the senblk at the head of a class of a priority queue
+ * Args: priority queue, class
+ * Returns: senblk
+ * Must be called with the queue's lock held and the class not empty
+ */
+static senblk_t *pq_take(struct prioq *pq, int c)
+{
+    struct prioent *e=&pq->ent[pq->head[c]];
+    int i=pq->head[c];
+
+    if ((pq->head[c]=e->next) < 0)
+        pq->tail[c]=-1;
+    e->next=pq->free;
+    pq->free=i;
+    pq->count--;
+    return(e->sptr);
+}
+
+/*
+ * Add a senblk to a priority queue
+ * Args: queue, senblk (whose reference the queue takes over)
+ * Returns: Nothing
+ * Side effects: If the queue is full the oldest senblk of the lowest class
+ * with any waiting is dropped, or the new senblk itself if it is of a lower
+ * class than any waiting
+ */
+static void pq_put(ioqueue_t *q, senblk_t *sptr)
+{
+    struct prioq *pq=q->pq;
+    senblk_t *old=NULL;
+    int c,low,i;
+
+    c=senpriority(sptr,q->owner->priority,pq->nclass-1);
+    pthread_mutex_lock(&pq->lock);
+    if (pq->count == pq->size) {
+        for (low=pq->nclass-1;pq->head[low] < 0;low--);
+        if (c > low) {
+            old=sptr;
+            sptr=NULL;
+        } else
+            old=pq_take(pq,low);
+        q->drops++;
+        stat_add(q->owner,drops,1);
+        DEBUG(4,"Dropped senblk q=0x%x",q);
+    }
+    if (sptr) {
+        i=pq->free;
+        pq->free=pq->ent[i].next;
+        pq->ent[i].sptr=sptr;
+        pq->ent[i].next=-1;
+        if (pq->tail[c] < 0)
+            pq->head[c]=i;
+        else
+            pq->ent[pq->tail[c]].next=i;
+        pq->tail[c]=i;
+        pq->count++;
+    }
+    pthread_mutex_unlock(&pq->lock);
+
+    if (old)
+        senblk_release(old);
+    if (sptr)
+        q_wake(q);
+}
+
+/*
+ * Take senblks from the inputs' queues feeding the engine without waiting
+ * Args: engine queue, array to return senblks in and its size
+ * Returns: Number of senblks returned
+ * Side effects: Inputs' queues are moved round the ready list, taken off it
+ * when empty and freed when empty and closed
+ * Only called by the engine
+ */
+static size_t merge_get(ioqueue_t *q, senblk_t **vec, size_t max)
+{
+    ioqueue_t *iq;
+    size_t n=0,got,want;
+
+    while (n < max) {
+        if ((iq=q->cur) == NULL) {
+            pthread_mutex_lock(&q->q_mutex);
+            if ((iq=q->rdyhead) != NULL && (q->rdyhead=iq->rdynext) == NULL)
+                q->rdytail=NULL;
+            pthread_mutex_unlock(&q->q_mutex);
+            if (iq == NULL)
+                break;
+            q->cur=iq;
+            q->quota=MERGEQUANTUM;
+        }
+
+        want=(max-n < (size_t) q->quota)?max-n:(size_t) q->quota;
+        n+=(got=q_get(iq,vec+n,want));
+        if ((q->quota-=got) && got == want)
+            /* Out of room but not out of quota: stay on this input */
+            break;
+
+        q->cur=NULL;
+        if (got < want) {
+            /* Empty when we looked */
+            if (!__atomic_load_n(&iq->active,__ATOMIC_ACQUIRE)) {
+                /* The input has finished so this is the final word */
+                if (!ring_busy(&iq->ring)) {
+                    input_q_free(iq);
+                    continue;
+                }
+            } else {
+                __atomic_store_n(&iq->ready,0,__ATOMIC_RELAXED);
+                /* Pairs with the fence in q_ready() */
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if ((__atomic_load_n(&iq->active,__ATOMIC_RELAXED) &&
+                        !ring_busy(&iq->ring)) ||
+                        __atomic_exchange_n(&iq->ready,1,__ATOMIC_ACQ_REL))
+                    continue;
+            }
+        }
+        /* Quota used up, or more arrived since we looked: to the back */
+        rdy_append(q,iq);
+    }
+    return(n);
+}
+
+/*
+ * Take senblks from the head of a queue without waiting
+ * Args: queue, array to return senblks in and its size
+ * Returns: Number of senblks returned
+ */
+static size_t q_get(ioqueue_t *q, senblk_t **vec, size_t max)
+{
+    struct conflate *cf;
+    struct prioq *pq;
+    size_t n;
+    int c;
+
+    if (q->kind == Q_MERGE)
+        return(merge_get(q,vec,max));
+
+    if (q->kind == Q_PRIO) {
+        pq=q->pq;
+        pthread_mutex_lock(&pq->lock);
+        for (n=0,c=0;c<pq->nclass;c++)
+            for (;n<max && pq->head[c] >= 0;n++)
+                vec[n]=pq_take(pq,c);
+        pthread_mutex_unlock(&pq->lock);
+        return(n);
+    }
+
+    if (q->kind != Q_CONFLATE) {
+        for (n=0;n<max && (vec[n]=ring_get(&q->ring)) != NULL;n++);
+        if (n && q->mq && q->stats)
+            __atomic_fetch_sub(&q->stats->backlog,n,__ATOMIC_RELAXED);
+        return(n);
+    }
+
+    cf=q->cf;
+    pthread_mutex_lock(&cf->lock);
+    for (n=0;n<max && cf->head != cf->tail;n++)
+        vec[n]=cf->ent[cf->head++ & cf->mask].sptr;
+    pthread_mutex_unlock(&cf->lock);
+    return(n);
+}
+
+/*
+ * Wait for data to arrive on an empty queue
+ * Args: queue
+ * Returns: Pointer to next senblk on the queue or NULL if the queue has been
+ * shut down
+ */
+static senblk_t *q_wait(ioqueue_t *q)
+{
+    senblk_t *tptr=NULL;
+    int done;
+
+    if (q->kind == Q_MERGE) {
+        /* Inputs put their queues on the ready list under the mutex, so
+         * there's no need for fences here */
+        do {
+            if (merge_get(q,&tptr,1))
+                break;
+            pthread_mutex_lock(&q->q_mutex);
+            while (q->rdyhead == NULL && q->active) {
+                q->waiting=1;
+                pthread_cond_wait(&q->freshmeat,&q->q_mutex);
+            }
+            q->waiting=0;
+            /* Once we've gone, inputs free their own queues.  See
+             * rdy_append() */
+            q->finished=done=(q->rdyhead == NULL);
+            pthread_mutex_unlock(&q->q_mutex);
+        } while (!done);
+        return(tptr);
+    }
+
+    pthread_mutex_lock(&q->q_mutex);
+    for (;;) {
+        __atomic_store_n(&q->waiting,1,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (q_get(q,&tptr,1) || !q->active)
+            break;
+        pthread_cond_wait(&q->freshmeat,&q->q_mutex);
+    }
+    __atomic_store_n(&q->waiting,0,__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->q_mutex);
+    return(tptr);
+}
+
+/*
+ * Add a senblk to a queue, dropping the oldest queued senblk if the queue
+ * is full
+ * Args: queue, senblk (whose reference the queue takes over)
+ * Returns: Nothing
+ */
+static void q_put(ioqueue_t *q, senblk_t *sptr)
+{
+    struct qring *r=&q->ring;
+    senblk_t *tptr;
+
+    if (q->kind == Q_CONFLATE) {
+        cf_put(q,sptr);
+        return;
+    }
+
+    if (q->kind == Q_PRIO) {
+        pq_put(q,sptr);
+        return;
+    }
+
+    /* Count it before the engine can take it */
+    if (q->mq && q->stats)
+        __atomic_fetch_add(&q->stats->backlog,1,__ATOMIC_RELAXED);
+
+    while (ring_tryput(r,sptr,q->single) < 0) {
+        if ((tptr=ring_get(r)) == NULL) {
+            /* Consumer is part way through taking the cell we want */
+            sched_yield();
+            continue;
+        }
+        senblk_release(tptr);
+        __atomic_fetch_add(&q->drops,1,__ATOMIC_RELAXED);
+        stat_add(q->owner,drops,1);
+        if (q->mq && q->stats)
+            __atomic_fetch_sub(&q->stats->backlog,1,__ATOMIC_RELAXED);
+        DEBUG(4,"Dropped senblk q=0x%x",q);
+    }
+
+    if (q->mq)
+        q_ready(q);
+    else
+        q_wake(q);
+}
+
+/*
+ * Write a copy of a senblk to a broadcast ring and wake any sleeping readers
+ * Args: broadcast ring, senblk
+ * Returns: Nothing
+ * Only engines write to broadcast rings.  If there's more than one they take
+ * turns
+ */
+static void bcast_put(ioqueue_t *q, senblk_t *sptr)
+{
+    unsigned long pos;
+    struct bslot *slot;
+    ioqueue_t *sq;
+
+    if (!q->single)
+        pthread_mutex_lock(&q->put_mutex);
+    pos=q->btail;
+    slot=&q->slots[pos & q->bmask];
+    __atomic_store_n(&slot->seq,2*pos+1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    (void) senblk_copy(&slot->sen,sptr);
+    __atomic_store_n(&slot->seq,2*pos+2,__ATOMIC_RELEASE);
+    __atomic_store_n(&q->btail,pos+1,__ATOMIC_RELEASE);
+    if (!q->single)
+        pthread_mutex_unlock(&q->put_mutex);
+
+    /* Pairs with the fences in bcast_wait() and poll_senblk_batch() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->waiting,__ATOMIC_RELAXED) == 0 &&
+            __atomic_load_n(&q->sleepers,__ATOMIC_RELAXED) == NULL)
+        return;
+
+    pthread_mutex_lock(&q->q_mutex);
+    pthread_cond_broadcast(&q->freshmeat);
+    /* Event loop readers are kicked under the mutex so they can't be freed
+     * (and their event fds closed) underneath us */
+    for (sq=q->sleepers;sq;sq=sq->sleepnext) {
+        sq->sleeping=0;
+        q_kick(sq);
+    }
+    q->sleepers=NULL;
+    pthread_mutex_unlock(&q->q_mutex);
+}
+
+/*
+ * Copy senblks from a broadcast ring to a reader
+ * Args: reader's cursor, array to return senblks in and its size
+ * Returns: Number of senblks returned
+ * Side effects: cursor updated.  Reader may be deactivated if lapped.
+ * Sentences which originated with the reader are skipped unless it has
+ * loopback set.
+ * Only the sentence's length is copied, not the whole of the slot's buffer.
+ * The copy is what lets us check the slot afterwards (see top of file)
+ */
+static size_t cursor_get(ioqueue_t *q, senblk_t **vec, size_t max)
+{
+    ioqueue_t *bq=q->bq;
+    struct bslot *slot;
+    senblk_t *tptr=NULL;
+    unsigned long tail,seq,pos=q->cursor;
+    unsigned int self=(flag_test(q->owner,F_LOOPBACK))?0:q->owner->id;
+    size_t n=0,len;
+
+    while (n < max && q->active) {
+        tail=__atomic_load_n(&bq->btail,__ATOMIC_ACQUIRE);
+        if (pos == tail)
+            break;
+
+        if (tail - pos > bq->bmask) {
+            /* Lapped before we even started on this slot */
+            seq=0;
+        } else {
+            slot=&bq->slots[pos & bq->bmask];
+            if ((seq=__atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE)) == 2*pos+2) {
+                if (tptr == NULL && (tptr=senblk_alloc()) == NULL)
+                    break;
+                if ((len=slot->sen.len) > SENBUFSZ)
+                    len=SENBUFSZ;
+                tptr->len=len;
+                tptr->src=slot->sen.src;
+                tptr->xsum=slot->sen.xsum;
+                tptr->ckstat=slot->sen.ckstat;
+                tptr->sclass=slot->sen.sclass;
+                tptr->key=slot->sen.key;
+                tptr->itime=slot->sen.itime;
+                tptr->etime=slot->sen.etime;
+                memcpy(tptr->data,slot->sen.data,len);
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (__atomic_load_n(&slot->seq,__ATOMIC_RELAXED) != seq)
+                    seq=0;
+            }
+        }
+
+        if (seq != 2*pos+2) {
+            /* The ring has overtaken us */
+            tail=__atomic_load_n(&bq->btail,__ATOMIC_ACQUIRE);
+            switch (bq->lapped) {
+            case LAP_DISCONNECT:
+                DEBUG(3,"%s id %x: lapped by broadcast ring: disconnecting",
+                        q->owner->name,q->owner->id);
+                q->active=0;
+                continue;
+            case LAP_RESYNC:
+                q->drops+=tail-pos;
+                stat_add(q->owner,drops,tail-pos);
+                pos=tail;
+                continue;
+            default:
+                /* Leave a slot's grace so we're not immediately lapped
+                 * again by the slot being written */
+                q->drops+=tail-bq->bmask-pos;
+                stat_add(q->owner,drops,tail-bq->bmask-pos);
+                pos=tail-bq->bmask;
+                continue;
+            }
+        }
+
+        pos++;
+        if (tptr->src == self && self)
+            continue;
+        vec[n++]=tptr;
+        tptr=NULL;
+    }
+
+    if (tptr)
+        senblk_release(tptr);
+    q->cursor=pos;
+    return(n);
+}
+
+static void bcast_wait_cleanup(void *arg)
+{
+    ioqueue_t *bq = (ioqueue_t *) arg;
+
+    __atomic_sub_fetch(&bq->waiting,1,__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&bq->q_mutex);
+}
+
+/*
+ * Wait for data on a broadcast ring
+ * Args: reader's cursor, array to return senblks in and its size
+ * Returns: Number of senblks returned or 0 if the reader is no longer active
+ */
+static size_t bcast_wait(ioqueue_t *q, senblk_t **vec, size_t max)
+{
+    ioqueue_t *bq=q->bq;
+    size_t n;
+
+    pthread_mutex_lock(&bq->q_mutex);
+    /* The ring's mutex is shared with other readers and the engine.  Don't
+     * leave it locked if our thread is told to exit while waiting */
+    pthread_cleanup_push(bcast_wait_cleanup,(void *) bq);
+    __atomic_add_fetch(&bq->waiting,1,__ATOMIC_RELAXED);
+    for (;;) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if ((n=cursor_get(q,vec,max)) || !q->active || !bq->active)
+            break;
+        pthread_cond_wait(&bq->freshmeat,&bq->q_mutex);
+    }
+    pthread_cleanup_pop(1);
+    return(n);
+}
+
+/*
+ *  Set up the pending sentence array of a conflating queue
+ *  Args: queue, maximum number of sentence types pending
+ *  Returns: 0 on success, -1 on failure
+ */
+static int init_conflate(ioqueue_t *q, size_t size)
+{
+    struct conflate *cf;
+    size_t n;
+
+    if ((cf=(struct conflate *) calloc(1,sizeof(struct conflate))) == NULL)
+        return(-1);
+
+    for (n=2;n<size;n<<=1);
+    if ((cf->ent=(struct cfent *) calloc(n,sizeof(struct cfent))) == NULL) {
+        free(cf);
+        return(-1);
+    }
+    cf->mask=n-1;
+    pthread_mutex_init(&cf->lock,NULL);
+    q->cf=cf;
+    q->kind=Q_CONFLATE;
+    return(0);
+}
+
+/*
+ *  Set up a priority queue if an interface has priority filters
+ *  Args: queue, interface it belongs to, number of entries shared by all
+ *  classes
+ *  Returns: 1 if the queue is a priority queue, 0 if the interface has no
+ *  priority filters, -1 on failure
+ *  Classes are numbered as the interface's priority filters, unset entries
+ *  in which are skipped by senpriority(), followed by the default class
+ */
+static int init_prio(ioqueue_t *q, iface_t *ifa, size_t size)
+{
+    struct prioq *pq;
+    int i,n;
+
+    for (n=MAXPRIO;n && ifa->priority[n-1] == NULL;n--);
+    if (n == 0)
+        return(0);
+
+    if ((pq=(struct prioq *) calloc(1,sizeof(struct prioq))) == NULL)
+        return(-1);
+    if (size < 1)
+        size=1;
+    if ((pq->ent=(struct prioent *) malloc(size*sizeof(struct prioent)))
+            == NULL) {
+        free(pq);
+        return(-1);
+    }
+    for (i=0;i<(int) size;i++)
+        pq->ent[i].next=i+1;
+    pq->ent[size-1].next=-1;
+    pq->size=size;
+    pq->nclass=n+1;
+    for (i=0;i<=MAXPRIO;i++)
+        pq->head[i]=pq->tail[i]=-1;
+    pthread_mutex_init(&pq->lock,NULL);
+    q->pq=pq;
+    q->kind=Q_PRIO;
+    return(1);
+}
+
+/*
+ *  Initialise the engine's queues, one for each engine thread
+ *  Args: engine iface_t, size of each input's queue
+ *  Returns: 0 on success, -1 on failure
+ *  Side effects: the engine's q points to the first of the array of shards
+ *  Inputs' queues are created as the inputs are
+ */
+static int init_merge_q(iface_t *ifa, size_t size)
+{
+    ioqueue_t *shards;
+    int i;
+
+    if ((shards=(ioqueue_t *)calloc(engines,sizeof(ioqueue_t))) == NULL)
+        return(-1);
+
+    for (i=0;i<engines;i++) {
+        shards[i].kind=Q_MERGE;
+        shards[i].insize=size;
+        shards[i].shards=shards;
+        shards[i].nshards=engines;
+        shards[i].owner=ifa;
+        shards[i].single=1;
+        pthread_mutex_init(&shards[i].q_mutex,NULL);
+        pthread_cond_init(&shards[i].freshmeat,NULL);
+        shards[i].active=1;
+        shards[i].evfd=-1;
+    }
+    ifa->q=shards;
+    return(0);
+}
+
+/*
+ *  Initialise an ioqueue
+ *  Args: iface_t to add queue to, size of queue (in senblk structures)
+ *  Returns: 0 on success, -1 on failure
+ */
+int init_q(iface_t *ifa, size_t size)
+{
+    ioqueue_t *newq;
+    pthread_condattr_t cattr;
+    int ret;
+
+    if (ifa->type == GLOBAL)
+        return(init_merge_q(ifa,size));
+
+    if ((newq=(ioqueue_t *)malloc(sizeof(ioqueue_t))) == NULL)
+        return(-1);
+    memset((void *)newq,0,sizeof(ioqueue_t));
+
+    if (ifa->flags & F_CONFLATE) {
+        if (init_conflate(newq,size) < 0) {
+            free(newq);
+            return(-1);
+        }
+        newq->cf->bysrc=(ifa->flags & F_CONFLATESRC)?1:0;
+    } else if ((ret=init_prio(newq,ifa,size)) < 0 ||
+            (ret == 0 && ring_init(&newq->ring,size) < 0)) {
+        free(newq);
+        return(-1);
+    }
+
+    newq->owner=ifa;
+
+    /* Each engine thread adds to outputs' queues */
+    newq->single=(engines == 1);
+
+    pthread_mutex_init(&newq->q_mutex,NULL);
+    /* Time waits against QCLOCK.  See timed_senblk_batch() */
+    pthread_condattr_init(&cattr);
+#ifndef __APPLE__
+    (void) pthread_condattr_setclock(&cattr,QCLOCK);
+#endif
+    pthread_cond_init(&newq->freshmeat,&cattr);
+    pthread_condattr_destroy(&cattr);
+
+    newq->active=1;
+    newq->evfd=-1;
+    ifa->q=newq;
+    return(0);
+}
+
+/*
+ *  Give an input its own queue to the engine
+ *  Args: input iface_t, engine's queue
+ *  Returns: 0 on success, -1 on failure
+ *  Inputs are dealt out to engine threads in turn.  An input stays with the
+ *  same engine thread until it exits
+ */
+int init_input_q(iface_t *ifa, ioqueue_t *mq)
+{
+    ioqueue_t *newq;
+
+    if (mq->nshards > 1)
+        mq=&mq->shards[__atomic_fetch_add(&mq->shards->nextshard,1,
+                __ATOMIC_RELAXED) % mq->nshards];
+
+    if ((newq=(ioqueue_t *)malloc(sizeof(ioqueue_t))) == NULL)
+        return(-1);
+    memset((void *)newq,0,sizeof(ioqueue_t));
+
+    if (ring_init(&newq->ring,mq->insize) < 0) {
+        free(newq);
+        return(-1);
+    }
+
+    newq->owner=ifa;
+    newq->stats=ifa->stats;
+    newq->mq=mq;
+    newq->single=1;
+    newq->active=1;
+    newq->evfd=-1;
+    ifa->q=newq;
+    return(0);
+}
+
+/*
+ *  Initialise a broadcast ring
+ *  Args: iface_t to add ring to, size of ring (in sentences) and policy for
+ *  readers which are lapped
+ *  Returns: 0 on success, -1 on failure
+ */
+int init_bcast_q(iface_t *ifa, size_t size, enum lapped lapped)
+{
+    ioqueue_t *newq;
+    size_t n;
+
+    if ((newq=(ioqueue_t *)malloc(sizeof(ioqueue_t))) == NULL)
+        return(-1);
+    memset((void *)newq,0,sizeof(ioqueue_t));
+
+    for (n=2;n<size;n<<=1);
+    if ((newq->slots=(struct bslot *) calloc(n,sizeof(struct bslot)))
+            == NULL) {
+        free(newq);
+        return(-1);
+    }
+
+    newq->kind=Q_BCAST;
+    newq->bmask=n-1;
+    newq->lapped=lapped;
+    newq->owner=ifa;
+    newq->refs=1;
+    newq->single=(engines == 1);
+    pthread_mutex_init(&newq->q_mutex,NULL);
+    pthread_cond_init(&newq->freshmeat,NULL);
+    pthread_mutex_init(&newq->put_mutex,NULL);
+
+    newq->active=1;
+    newq->evfd=-1;
+    ifa->q=newq;
+    return(0);
+}
+
+/*
+ *  Initialise a reader's cursor on a broadcast ring
+ *  Args: iface_t to add cursor to, broadcast ring
+ *  Returns: 0 on success, -1 on failure
+ *  New readers start with the next sentence written to the ring
+ */
+int init_cursor_q(iface_t *ifa, ioqueue_t *bq)
+{
+    ioqueue_t *newq;
+
+    if ((newq=(ioqueue_t *)malloc(sizeof(ioqueue_t))) == NULL)
+        return(-1);
+    memset((void *)newq,0,sizeof(ioqueue_t));
+
+    newq->kind=Q_CURSOR;
+    newq->owner=ifa;
+    newq->bq=bq;
+    newq->active=1;
+    newq->evfd=-1;
+
+    pthread_mutex_lock(&bq->q_mutex);
+    bq->refs++;
+    newq->cursor=__atomic_load_n(&bq->btail,__ATOMIC_ACQUIRE);
+    pthread_mutex_unlock(&bq->q_mutex);
+
+    ifa->q=newq;
+    return(0);
+}
+
+/*
+ * Drop a reference to a broadcast ring, freeing it if that was the last
+ * Args: broadcast ring
+ * Returns: Nothing
+ * Should be called with the ring's mutex held.  Releases it.
+ */
+static void bcast_unref(ioqueue_t *q)
+{
+    if (--q->refs) {
+        pthread_mutex_unlock(&q->q_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&q->q_mutex);
+    pthread_mutex_destroy(&q->q_mutex);
+    pthread_cond_destroy(&q->freshmeat);
+    pthread_mutex_destroy(&q->put_mutex);
+    free(q->slots);
+    free(q);
+}
+
+/*
+ * Free a queue, releasing anything still on it
+ * Args: Queue to be freed
+ * Returns: Nothing
+ */
+void free_q(ioqueue_t *q)
+{
+    ioqueue_t **sqp;
+
+    if (q == NULL)
+        return;
+
+    if (q->mq) {
+        /* An input's queue may still have sentences on it.  Leave it for the
+         * engine to free once it's taken them (q_ready() frees it now if
+         * the engine has gone) */
+        __atomic_store_n(&q->active,0,__ATOMIC_RELEASE);
+        q_ready(q);
+        return;
+    }
+
+    switch (q->kind) {
+    case Q_BCAST:
+        /* Readers may outlive us.  Tell them there's nothing more coming */
+        pthread_mutex_lock(&q->q_mutex);
+        q->active=0;
+        pthread_cond_broadcast(&q->freshmeat);
+        for (;q->sleepers;q->sleepers=q->sleepers->sleepnext) {
+            q->sleepers->sleeping=0;
+            q_kick(q->sleepers);
+        }
+        bcast_unref(q);
+        return;
+    case Q_CURSOR:
+        pthread_mutex_lock(&q->bq->q_mutex);
+        if (q->sleeping)
+            for (sqp=&q->bq->sleepers;*sqp;sqp=&(*sqp)->sleepnext)
+                if (*sqp == q) {
+                    *sqp=q->sleepnext;
+                    break;
+                }
+        bcast_unref(q->bq);
+        free(q);
+        return;
+    default:
+        break;
+    }
+
+    flush_queue(q);
+    pthread_mutex_destroy(&q->q_mutex);
+    pthread_cond_destroy(&q->freshmeat);
+    if (q->cf) {
+        pthread_mutex_destroy(&q->cf->lock);
+        free(q->cf->ent);
+        free(q->cf);
+    }
+    if (q->pq) {
+        pthread_mutex_destroy(&q->pq->lock);
+        free(q->pq->ent);
+        free(q->pq);
+    }
+    free(q->ring.cells);
+    free(q);
+}
+
+/*
+ * Add a copy of an senblk to an ioqueue
+ * Args: Pointer to senblk and Pointer to queue it is to be added to
+ * Returns: None
+ */
+void push_senblk(senblk_t *sptr, ioqueue_t *q)
+{
+    senblk_t *tptr;
+    int i;
+
+    if (sptr == NULL) {
+        /* NULL senblk pointer is magic "off" switch for a queue */
+        if (q->kind == Q_MERGE) {
+            /* Switch off all the engine threads */
+            for (i=0;i<q->nshards;i++) {
+                pthread_mutex_lock(&q->shards[i].q_mutex);
+                q->shards[i].active = 0;
+                pthread_cond_broadcast(&q->shards[i].freshmeat);
+                pthread_mutex_unlock(&q->shards[i].q_mutex);
+            }
+            return;
+        }
+        if (q->kind == Q_CURSOR) {
+            q->active = 0;
+            q_kick(q);
+            return;
+        }
+        pthread_mutex_lock(&q->q_mutex);
+        q->active = 0;
+        pthread_cond_broadcast(&q->freshmeat);
+        if (q->kind == Q_BCAST)
+            /* Event loop readers aren't waiting on the condition variable */
+            for (;q->sleepers;q->sleepers=q->sleepers->sleepnext) {
+                q->sleepers->sleeping=0;
+                q_kick(q->sleepers);
+            }
+        pthread_mutex_unlock(&q->q_mutex);
+        if (q->evfd >= 0)
+            q_kick(q);
+        return;
+    }
+
+    if (q->kind == Q_BCAST) {
+        bcast_put(q,sptr);
+        return;
+    }
+
+    if ((tptr=senblk_alloc()) == NULL) {
+        DEBUG(4,"Dropped senblk q=0x%x",q);
+        return;
+    }
+
+    (void) senblk_copy(tptr,sptr);
+    q_put(q,tptr);
+}
+
+/*
+ * Add a senblk to an ioqueue without copying it
+ * Args: Pointer to senblk taken from another queue and Pointer to queue it is
+ * to be added to
+ * Returns: None
+ * Side Effects: senblk reference count incremented
+ */
+void share_senblk(senblk_t *sptr, ioqueue_t *q)
+{
+    if (q->kind == Q_BCAST) {
+        bcast_put(q,sptr);
+        return;
+    }
+    __atomic_add_fetch(&sptr->refcnt,1,__ATOMIC_RELAXED);
+    q_put(q,sptr);
+}
+
+/*
+ * Take an additional reference to a senblk, for holding on to it outside
+ * of a queue
+ * Args: Pointer to senblk
+ * Returns: Nothing
+ * Side Effects: senblk reference count incremented.  Drop the reference with
+ * senblk_free()
+ */
+void senblk_ref(senblk_t *sptr)
+{
+    __atomic_add_fetch(&sptr->refcnt,1,__ATOMIC_RELAXED);
+}
+
+/*
+ *  Get the next senblk from the head of a queue
+ *  Args: Queue to retrieve from
+ *  Returns: Pointer to next senblk on the queue or NULL if the queue is
+ *  no longer active
+ *  This function blocks until data are available or the queue is shut down
+ */
+senblk_t *next_senblk(ioqueue_t *q)
+{
+    senblk_t *tptr;
+
+    if (q->kind == Q_CURSOR)
+        return(next_senblk_batch(q,&tptr,1)?tptr:NULL);
+
+    if (q_get(q,&tptr,1))
+        return(tptr);
+
+    return(q_wait(q));
+}
+
+/*
+ *  Get as many senblks as are available from the head of a queue
+ *  Args: Queue to retrieve from, array to return senblks in and its size
+ *  Returns: Number of senblks returned or 0 if the queue is no longer active
+ *  This function blocks until data are available or the queue is shut down
+ */
+size_t next_senblk_batch(ioqueue_t *q, senblk_t **vec, size_t max)
+{
+    size_t n;
+
+    if (q->kind == Q_CURSOR) {
+        if ((n=cursor_get(q,vec,max)))
+            return(n);
+        return(bcast_wait(q,vec,max));
+    }
+
+    if ((vec[0]=next_senblk(q)) == NULL)
+        return(0);
+
+    return(1+q_get(q,vec+1,max-1));
+}
+
+/*
+ *  Get as many senblks as are available from the head of a queue without
+ *  blocking.  For consumers which wait on the queue's event fd
+ *  Args: Queue to retrieve from, array to return senblks in and its size
+ *  Returns: Number of senblks returned
+ *  Side effects: If the queue is empty, the consumer is marked as waiting
+ *  so that the next senblk added will kick the queue's event fd
+ */
+size_t poll_senblk_batch(ioqueue_t *q, senblk_t **vec, size_t max)
+{
+    size_t n;
+
+    if (q->kind == Q_CURSOR) {
+        if ((n=cursor_get(q,vec,max)) || !q->active)
+            return(n);
+        pthread_mutex_lock(&q->bq->q_mutex);
+        if (!q->sleeping && q->bq->active) {
+            q->sleeping=1;
+            q->sleepnext=q->bq->sleepers;
+            __atomic_store_n(&q->bq->sleepers,q,__ATOMIC_RELAXED);
+        } else if (!q->bq->active)
+            q->active=0;
+        pthread_mutex_unlock(&q->bq->q_mutex);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        return(cursor_get(q,vec,max));
+    }
+
+    if ((n=q_get(q,vec,max)))
+        return(n);
+
+    __atomic_store_n(&q->waiting,1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if ((n=q_get(q,vec,max)))
+        __atomic_store_n(&q->waiting,0,__ATOMIC_RELAXED);
+    return(n);
+}
+
+/*
+ *  Get as many senblks as are available from the head of a queue, waiting
+ *  for the first no later than a deadline
+ *  Args: Queue to retrieve from, array to return senblks in and its size,
+ *  absolute (QCLOCK) deadline or NULL to wait indefinitely
+ *  Returns: Number of senblks returned, 0 if the deadline passed with the queue
+ *  empty or -1 if the queue is no longer active
+ *  Broadcast ring readers always wait indefinitely
+ */
+int timed_senblk_batch(ioqueue_t *q, senblk_t **vec, size_t max,
+        struct timespec *abstime)
+{
+    size_t n;
+    int active,ret=0;
+
+    if (abstime == NULL || q->kind == Q_CURSOR)
+        return((n=next_senblk_batch(q,vec,max))?(int)n:-1);
+
+    if ((n=q_get(q,vec,max)))
+        return(n);
+
+    pthread_mutex_lock(&q->q_mutex);
+    for (;;) {
+        __atomic_store_n(&q->waiting,1,__ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        /* Check active before the ring so nothing queued ahead of the
+         * shutdown is missed */
+        active=q->active;
+        if ((n=q_get(q,vec,1)) || !active || ret == ETIMEDOUT)
+            break;
+        ret=pthread_cond_timedwait(&q->freshmeat,&q->q_mutex,abstime);
+    }
+    __atomic_store_n(&q->waiting,0,__ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->q_mutex);
+
+    if (n == 0)
+        return(active?0:-1);
+
+    return(1+q_get(q,vec+1,max-1));
+}
+
+/*
+ *  Get the last senblk from a queue, discarding all before it
+ *  Args: Queue to retrieve from
+ *  Returns: Pointer to last senblk on the queue or NULL if the queue is
+ *  no longer active
+ *  This function blocks until data are available or the queue is shut down
+ */
+senblk_t *last_senblk(ioqueue_t *q)
+{
+    senblk_t *tptr,*nptr;
+
+    if (q->kind == Q_CURSOR) {
+        flush_queue(q);
+        if (q->cursor)
+            q->cursor--;
+        return(next_senblk(q));
+    }
+
+    /* Release all but last senblk on the queue */
+    for (tptr=NULL;q_get(q,&nptr,1);tptr=nptr)
+        if (tptr)
+            senblk_free(tptr,q);
+
+    if (tptr)
+        return(tptr);
+
+    return(q_wait(q));
+}
+
+/*
+ * Flush a queue, releasing anything on it
+ * Args: Queue to be flushed
+ * Returns: Nothing
+ * Side Effect: Anything on the queue is released
+ */
+void flush_queue(ioqueue_t *q)
+{
+    senblk_t *tptr;
+
+    if (q->kind == Q_CURSOR) {
+        q->cursor=__atomic_load_n(&q->bq->btail,__ATOMIC_ACQUIRE);
+        return;
+    }
+
+    while (q_get(q,&tptr,1))
+        senblk_free(tptr,q);
+}
+
+/*
+ * Finish with a senblk taken from a queue
+ * Args: pointer to senblk, and pointer to the queue it was taken from
+ * Returns: Nothing
+ */
+void senblk_free(senblk_t *sptr, ioqueue_t *q)
+{
+    senblk_release(sptr);
+}
+
+/*
+ * Finish with an array of senblks taken from a queue
+ * Args: array of senblks, number of senblks in the array, and pointer to the
+ * queue they were taken from
+ * Returns: Nothing
+ */
+void senblk_free_batch(senblk_t **vec, size_t n, ioqueue_t *q)
+{
+    while (n)
+        senblk_release(vec[--n]);
+}
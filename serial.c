@@ -10,6 +10,7 @@
  */
 
 #include "kplex.h"
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -212,65 +213,36 @@ ssize_t read_serial(struct iface *ifa, char *buf)
 void write_serial(struct iface *ifa)
 {
     struct if_serial *ifs = (struct if_serial *) ifa->info;
-    senblk_t *senblk_p;
+    senblk_t *vec[BATCHMAX];
+    struct iovec iov[BATCHIOV];
+    size_t n;
     int fd=ifs->fd;
-    int n=0,tlen=0;
-    char *ptr;
-    char *tbuf;
+    int stride;
+    char *tbuf=NULL;
 
     if (ifa->tagflags) {
-        if ((tbuf=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*BATCHMAX)) == NULL) {
             logerr(errno,"Disabing tag output on interface id %u (%s)",
                 ifa->id,(ifa->name)?ifa->name:"unlabelled");
             ifa->tagflags=0;
         }
     }
 
-    while(n >= 0) {
-        /* NULL return from next_senblk means the queue has been shut
+    for (;;) {
+        /* 0 return from next_senblk_batch means the queue has been shut
          * down. Time to die */
-        if ((senblk_p = next_senblk(ifa->q)) == NULL)
+        if ((n = next_senblk_batch(ifa->q,vec,BATCHMAX)) == 0)
             break;
 
-        if (senfilter(senblk_p,ifa->ofilter)) {
-            senblk_free(senblk_p,ifa->q);
-            continue;
-        }
-
-        if (ifa->tagflags) {
-            if ((tlen = gettag(ifa,tbuf,senblk_p)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %u (%s)",
-                    ifa->id,(ifa->name)?ifa->name:"unlabelled");
-                ifa->tagflags=0;
-                free(tbuf);
-            }
-            ptr=tbuf;
-            while(tlen) {
-                if ((n=write(fd,ptr,tlen)) < 0)
-                    break;
-                tlen-=n;
-                ptr+=n;
-            }
-            if (tlen) {
-                senblk_free(senblk_p,ifa->q);
-                break;
-            }
-        }
-
-        ptr=senblk_p->data;
-        tlen=senblk_p->len;
-        while(tlen) {
-            if ((n=write(fd,ptr,tlen)) < 0)
-                break;
-            tlen-=n;
-            ptr+=n;
-        }
-        senblk_free(senblk_p,ifa->q);
-        if (tlen)
+        stride=senblk_iov(ifa,vec,&n,iov,tbuf,0);
+        if (n && writev_all(fd,iov,n*stride) < 0) {
+            senblk_free_batch(vec,n,ifa->q);
             break;
+        }
+        senblk_free_batch(vec,n,ifa->q);
     }
 
-    if (ifa->tagflags)
+    if (tbuf)
         free(tbuf);
 
     iface_thread_exit(errno);
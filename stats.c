@@ -0,0 +1,612 @@
+/* stats.c
+ * This file is part of kplex
+ * Copyright Keith Young 2012-2016
+ * For copying information see the file COPYING distributed with this software
+ *
+ * Interface statistics.  With the "stats" global option each configured
+ * interface (and the engine) gets a set of counters shared by any
+ * connections it accepts, updated with relaxed atomic adds and never locked.
+ * Sentences are timed when read (using the kernel's receive timestamp where
+ * there is one), when the engine passes them to the outputs and when they are
+ * written.  The engine keeps a histogram of the time from reading to the
+ * engine, and outputs one of the time from the engine to writing and one of
+ * the total.  Buckets are log-linear: 8 per power of two, so any value is
+ * within 12.5% of its bucket's bounds.
+ *
+ * The counters are served over http from a local tcp port or unix socket:
+ * "/metrics" in Prometheus text format and "/" or "/stats" as JSON.
+ */
+
+#include "kplex.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <netdb.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <fcntl.h>
+
+#define STATSREQMAX 1024
+#define STATSCONNS 16       /* Connections waiting to send requests */
+#define STATSTIMEOUT 2000   /* Milliseconds for a client to send a request */
+
+/* Interface statistics, indexed by the major part of the interface id.
+ * Entry 0 is the engine */
+static struct ifstats *ifstats;
+static unsigned int nifstats;
+
+/* Growable buffer for building responses */
+struct sbuf {
+    char *buf;
+    size_t len;
+    size_t size;
+    int err;
+};
+
+/* A connection to the statistics server waiting to send its request */
+struct statsconn {
+    int fd;
+    size_t len;
+    uint64_t deadline;      /* monousecs() by which to have a request */
+    char req[STATSREQMAX];
+};
+
+/*
+ * Allocate statistics for the engine and a number of interfaces
+ * Args: Number of entries (including the engine's)
+ * Returns: Pointer to the array of statistics or NULL on failure
+ */
+struct ifstats *new_stats(unsigned int n)
+{
+    if ((ifstats=(struct ifstats *) calloc(n,sizeof(struct ifstats))) == NULL)
+        return(NULL);
+    nifstats=n;
+    return(ifstats);
+}
+
+/*
+ * Find the histogram bucket for a latency
+ * Args: latency in microseconds
+ * Returns: bucket index
+ */
+static unsigned int lat_bucket(uint64_t us)
+{
+    unsigned int e,idx;
+
+    if (us < 8)
+        return((unsigned int) us);
+    e=63-__builtin_clzll(us);
+    idx=(e-2)*8+((us>>(e-3))&7);
+    return((idx < LATBUCKETS)?idx:LATBUCKETS-1);
+}
+
+/*
+ * Find the smallest latency recorded in a histogram bucket
+ * Args: bucket index
+ * Returns: bucket's lower bound in microseconds
+ */
+static uint64_t lat_lower(unsigned int idx)
+{
+    if (idx < 8)
+        return(idx);
+    return((uint64_t) (8+idx%8) << (idx/8-1));
+}
+
+/*
+ * Add a latency to a histogram
+ * Args: histogram, latency in microseconds
+ * Returns: Nothing
+ */
+void lat_add(struct lathist *h, uint64_t us)
+{
+    unsigned long max;
+
+    __atomic_fetch_add(&h->n[lat_bucket(us)],1,__ATOMIC_RELAXED);
+    __atomic_fetch_add(&h->sum,us,__ATOMIC_RELAXED);
+
+    /* Any number of threads may be adding to the histogram.  On failure the
+     * compare and swap updates max with the competing value */
+    max=__atomic_load_n(&h->max,__ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&h->max,&max,
+            (unsigned long) us,1,__ATOMIC_RELAXED,__ATOMIC_RELAXED));
+}
+
+/*
+ * Record the latencies of a batch of sentences
+ * Args: output interface, array of senblks about to be written and its size
+ * Returns: Nothing
+ */
+void stat_latency(iface_t *ifa, senblk_t **vec, size_t n)
+{
+    struct ifstats *st=ifa->stats;
+    uint64_t now;
+    size_t i;
+
+    if (st == NULL || n == 0)
+        return;
+
+    now=preciseusecs();
+    for (i=0;i<n;i++) {
+        if (vec[i]->etime)
+            lat_add(&st->wait,(now > vec[i]->etime)?now-vec[i]->etime:0);
+        if (vec[i]->itime)
+            lat_add(&st->total,(now > vec[i]->itime)?now-vec[i]->itime:0);
+    }
+}
+
+/*
+ * Append formatted text to a response buffer
+ * Args: buffer, format and arguments as for printf
+ * Returns: Nothing
+ * Side effects: buffer's error flag is set if it can't be grown
+ */
+static void sbprintf(struct sbuf *sb, const char *fmt, ...)
+{
+    va_list ap;
+    char *tptr;
+    int n;
+
+    for (;;) {
+        if (sb->err)
+            return;
+        va_start(ap,fmt);
+        n=vsnprintf(sb->buf+sb->len,sb->size-sb->len,fmt,ap);
+        va_end(ap);
+        if (n < 0) {
+            sb->err=1;
+            return;
+        }
+        if ((size_t) n < sb->size-sb->len) {
+            sb->len+=n;
+            return;
+        }
+        if ((tptr=(char *) realloc(sb->buf,2*sb->size+n)) == NULL) {
+            sb->err=1;
+            return;
+        }
+        sb->buf=tptr;
+        sb->size=2*sb->size+n;
+    }
+}
+
+/*
+ * Take a copy of a histogram
+ * Args: histogram, array of LATBUCKETS counts to fill in
+ * Returns: Total number of latencies recorded
+ */
+static unsigned long lat_copy(struct lathist *h, unsigned long *lat)
+{
+    unsigned long total=0;
+    int i;
+
+    for (i=0;i<LATBUCKETS;i++)
+        total+=(lat[i]=__atomic_load_n(&h->n[i],__ATOMIC_RELAXED));
+    return(total);
+}
+
+/*
+ * Find a percentile of a histogram
+ * Args: histogram, total count, percentile (0-1)
+ * Returns: Upper bound in microseconds of the bucket holding the percentile
+ */
+static uint64_t lat_pct(unsigned long *lat, unsigned long total, double pct)
+{
+    unsigned long want,cum=0;
+    unsigned int i;
+
+    if ((want=(unsigned long) (pct*total+0.5)) == 0)
+        want=1;
+    for (i=0;i<LATBUCKETS-1;i++)
+        if ((cum+=lat[i]) >= want)
+            break;
+    return((i < LATBUCKETS-1)?lat_lower(i+1)-1:lat_lower(i));
+}
+
+#define ldst(st,c) __atomic_load_n(&(st)->c,__ATOMIC_RELAXED)
+
+/*
+ * Add a histogram's count, mean and percentiles to JSON statistics
+ * Args: buffer, name to give them, histogram
+ * Returns: Nothing
+ */
+static void lat_json(struct sbuf *sb, char *name, struct lathist *h)
+{
+    unsigned long lat[LATBUCKETS],total;
+
+    if ((total=lat_copy(h,lat)) == 0)
+        return;
+    sbprintf(sb,",\"%s\":{\"count\":%lu,\"mean\":%lu,\"p50\":%llu,"
+            "\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%lu}",name,
+            total,ldst(h,sum)/total,
+            (unsigned long long) lat_pct(lat,total,0.5),
+            (unsigned long long) lat_pct(lat,total,0.9),
+            (unsigned long long) lat_pct(lat,total,0.99),
+            (unsigned long long) lat_pct(lat,total,0.999),ldst(h,max));
+}
+
+/*
+ * Build the statistics as JSON
+ * Args: buffer to build them in
+ * Returns: Nothing
+ */
+static void stats_json(struct sbuf *sb)
+{
+    struct ifstats *st;
+    unsigned int i;
+    char *sep="";
+
+    sbprintf(sb,"{\"interfaces\":[");
+    for (i=0;i<nifstats;i++) {
+        st=&ifstats[i];
+        if (st->name == NULL)
+            continue;
+        sbprintf(sb,"%s\n{\"name\":\"%s\",\"type\":\"%s\",\"insentences\":%lu,"
+                "\"inbytes\":%lu,\"outsentences\":%lu,\"outbytes\":%lu,"
+                "\"badsum\":%lu,\"filtered\":%lu,\"drops\":%lu,"
+                "\"reconnects\":%lu,\"backlog\":%lu",sep,st->name,st->type,
+                ldst(st,insens),ldst(st,inbytes),ldst(st,outsens),
+                ldst(st,outbytes),ldst(st,badsum),ldst(st,filtered),
+                ldst(st,drops),ldst(st,reconnects),ldst(st,backlog));
+        lat_json(sb,"wait",&st->wait);
+        lat_json(sb,"total",&st->total);
+        sbprintf(sb,"}");
+        sep=",";
+    }
+    sbprintf(sb,"\n]}\n");
+}
+
+/* Counters served in Prometheus format */
+static struct {
+    char *name;
+    char *help;
+    size_t offset;
+} promctr[] = {
+    { "kplex_in_sentences_total", "Sentences received",
+        offsetof(struct ifstats,insens) },
+    { "kplex_in_bytes_total", "Bytes of sentences received",
+        offsetof(struct ifstats,inbytes) },
+    { "kplex_out_sentences_total", "Sentences written",
+        offsetof(struct ifstats,outsens) },
+    { "kplex_out_bytes_total", "Bytes of sentences written",
+        offsetof(struct ifstats,outbytes) },
+    { "kplex_checksum_errors_total", "Sentences dropped for bad checksums",
+        offsetof(struct ifstats,badsum) },
+    { "kplex_filtered_total", "Sentences rejected by filters or dedup",
+        offsetof(struct ifstats,filtered) },
+    { "kplex_queue_drops_total", "Sentences lost from full queues",
+        offsetof(struct ifstats,drops) },
+    { "kplex_reconnects_total", "Connections re-established",
+        offsetof(struct ifstats,reconnects) },
+    { NULL, NULL, 0 }
+};
+
+/*
+ * Add a Prometheus histogram for each interface to statistics
+ * Args: buffer, metric name, help text, offset of the histogram in
+ * struct ifstats
+ * Returns: Nothing
+ * Interfaces which have never recorded a latency are left out
+ */
+static void lat_prom(struct sbuf *sb, char *name, char *help, size_t offset)
+{
+    unsigned long lat[LATBUCKETS],cum;
+    struct lathist *h;
+    unsigned int i,j;
+
+    sbprintf(sb,"# HELP %s %s\n# TYPE %s histogram\n",name,help,name);
+    for (i=0;i<nifstats;i++) {
+        if (ifstats[i].name == NULL)
+            continue;
+        h=(struct lathist *) ((char *) &ifstats[i]+offset);
+        if (lat_copy(h,lat) == 0)
+            continue;
+        /* One bucket for each power of two microseconds */
+        for (cum=0,j=0;j<LATBUCKETS;j++) {
+            cum+=lat[j];
+            if (j%8 == 7 && j < LATBUCKETS-1)
+                sbprintf(sb,"%s_bucket{interface=\"%s\",le=\"%.6f\"} %lu\n",
+                        name,ifstats[i].name,(lat_lower(j+1)-1)/1e6,cum);
+        }
+        sbprintf(sb,"%s_bucket{interface=\"%s\",le=\"+Inf\"} %lu\n",name,
+                ifstats[i].name,cum);
+        sbprintf(sb,"%s_sum{interface=\"%s\"} %.6f\n",name,ifstats[i].name,
+                ldst(h,sum)/1e6);
+        sbprintf(sb,"%s_count{interface=\"%s\"} %lu\n",name,
+                ifstats[i].name,cum);
+    }
+}
+
+/*
+ * Build the statistics in Prometheus text format
+ * Args: buffer to build them in
+ * Returns: Nothing
+ */
+static void stats_prom(struct sbuf *sb)
+{
+    struct ifstats *st;
+    unsigned int i,j;
+
+    for (j=0;promctr[j].name;j++) {
+        sbprintf(sb,"# HELP %s %s\n# TYPE %s counter\n",promctr[j].name,
+                promctr[j].help,promctr[j].name);
+        for (i=0;i<nifstats;i++) {
+            st=&ifstats[i];
+            if (st->name == NULL)
+                continue;
+            sbprintf(sb,"%s{interface=\"%s\",type=\"%s\"} %lu\n",
+                    promctr[j].name,st->name,st->type,__atomic_load_n(
+                    (unsigned long *) ((char *) st+promctr[j].offset),
+                    __ATOMIC_RELAXED));
+        }
+    }
+
+    sbprintf(sb,"# HELP kplex_backlog Sentences waiting for the engine\n"
+            "# TYPE kplex_backlog gauge\n");
+    for (i=0;i<nifstats;i++) {
+        st=&ifstats[i];
+        if (st->name == NULL)
+            continue;
+        sbprintf(sb,"kplex_backlog{interface=\"%s\",type=\"%s\"} %lu\n",
+                st->name,st->type,ldst(st,backlog));
+    }
+
+    lat_prom(sb,"kplex_wait_seconds","Time from read to engine (engine) "
+            "or engine to write (outputs)",offsetof(struct ifstats,wait));
+    lat_prom(sb,"kplex_latency_seconds","Time from read to write",
+            offsetof(struct ifstats,total));
+}
+
+/*
+ * Answer a request on a connection to the statistics server
+ * Args: connected socket, request read from it (nul terminated)
+ * Returns: Nothing
+ */
+static void stats_request(int fd, char *req)
+{
+    struct sbuf sb;
+    struct timeval tv;
+    struct iovec iov[2];
+    char hdr[128];
+    char *path,*type;
+    int flags;
+
+    if (strncmp(req,"GET ",4))
+        return;
+    path=req+4;
+    path[strcspn(path," \r\n?")]='\0';
+
+    memset(&sb,0,sizeof(sb));
+    if ((sb.buf=(char *) malloc(sb.size=BUFSIZ)) == NULL)
+        return;
+
+    if (!strcmp(path,"/metrics")) {
+        type="text/plain; version=0.0.4";
+        stats_prom(&sb);
+    } else if (!strcmp(path,"/") || !strcmp(path,"/stats")) {
+        type="application/json";
+        stats_json(&sb);
+    } else {
+        type=NULL;
+        sb.len=0;
+    }
+
+    if (sb.err) {
+        free(sb.buf);
+        return;
+    }
+
+    /* The response may be larger than the socket buffer.  Block writing it,
+     * but not for long if the client isn't reading */
+    if ((flags=fcntl(fd,F_GETFL)) >= 0)
+        (void) fcntl(fd,F_SETFL,flags & ~O_NONBLOCK);
+    tv.tv_sec=STATSTIMEOUT/1000;
+    tv.tv_usec=(STATSTIMEOUT%1000)*1000;
+    (void) setsockopt(fd,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(tv));
+
+    iov[0].iov_base=hdr;
+    if (type)
+        iov[0].iov_len=snprintf(hdr,sizeof(hdr),"HTTP/1.0 200 OK\r\n"
+                "Content-Type: %s\r\nContent-Length: %lu\r\n\r\n",type,
+                (unsigned long) sb.len);
+    else
+        iov[0].iov_len=snprintf(hdr,sizeof(hdr),"HTTP/1.0 404 Not Found\r\n"
+                "Content-Length: 0\r\n\r\n");
+    iov[1].iov_base=sb.buf;
+    iov[1].iov_len=sb.len;
+    (void) writev_all(fd,iov,2);
+    free(sb.buf);
+}
+
+/*
+ * Read what's available of a request on a connection to the statistics
+ * server, answering it once it's all there
+ * Args: connection
+ * Returns: 1 if the connection is finished with, 0 if more is to come
+ * Only the request line matters
+ */
+static int stats_read(struct statsconn *sc)
+{
+    ssize_t n;
+
+    if ((n=read(sc->fd,sc->req+sc->len,sizeof(sc->req)-1-sc->len)) < 0)
+        return(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK);
+    sc->len+=n;
+    sc->req[sc->len]='\0';
+    if (n == 0 || strchr(sc->req,'\n') || sc->len == sizeof(sc->req)-1) {
+        stats_request(sc->fd,sc->req);
+        return(1);
+    }
+    return(0);
+}
+
+/*
+ * Statistics server thread
+ * Args: listening socket (cast to void *)
+ * Returns: Nothing
+ * Connections are polled so that a client which is slow to send its
+ * request doesn't hold up the others.  Any which haven't sent a request
+ * line within STATSTIMEOUT milliseconds are closed, as is the oldest if
+ * there are already STATSCONNS when another arrives.
+ */
+static void *serve_stats(void *arg)
+{
+    int lfd=(int) (intptr_t) arg;
+    struct statsconn conns[STATSCONNS];
+    struct pollfd pfd[STATSCONNS+1];
+    uint64_t now,wait;
+    int fd,flags,i,n,nconns=0,ms;
+
+    (void) pthread_detach(pthread_self());
+
+    for (;;) {
+        pfd[0].fd=lfd;
+        pfd[0].events=POLLIN;
+        now=monousecs();
+        for (ms=-1,i=0;i<nconns;i++) {
+            pfd[i+1].fd=conns[i].fd;
+            pfd[i+1].events=POLLIN;
+            wait=(conns[i].deadline > now)?conns[i].deadline-now:0;
+            if (ms < 0 || (uint64_t) ms > (wait+999)/1000)
+                ms=(int) ((wait+999)/1000);
+        }
+
+        if (poll(pfd,nconns+1,ms) < 0) {
+            if (errno == EINTR)
+                continue;
+            logerr(errno,"Statistics server failed");
+            break;
+        }
+
+        /* Work from the end so that removing a connection (by moving the
+         * last one into its place) doesn't disturb those still to do */
+        now=monousecs();
+        for (i=nconns-1;i>=0;i--) {
+            if ((pfd[i+1].revents && stats_read(&conns[i])) ||
+                    now >= conns[i].deadline) {
+                close(conns[i].fd);
+                conns[i]=conns[--nconns];
+            }
+        }
+
+        if (!(pfd[0].revents & POLLIN))
+            continue;
+        if ((fd=accept(lfd,NULL,NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED ||
+                    errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+            if (errno == EMFILE || errno == ENFILE) {
+                mysleep(1);
+                continue;
+            }
+            logerr(errno,"Statistics server failed");
+            break;
+        }
+        if ((flags=fcntl(fd,F_GETFL)) < 0 ||
+                fcntl(fd,F_SETFL,flags|O_NONBLOCK) < 0) {
+            close(fd);
+            continue;
+        }
+        if (nconns == STATSCONNS) {
+            /* Make room by giving up on the connection waited for longest */
+            for (n=0,i=1;i<nconns;i++)
+                if (conns[i].deadline < conns[n].deadline)
+                    n=i;
+            close(conns[n].fd);
+            conns[n]=conns[--nconns];
+        }
+        conns[nconns].fd=fd;
+        conns[nconns].len=0;
+        conns[nconns].deadline=now+STATSTIMEOUT*1000;
+        nconns++;
+    }
+    for (i=0;i<nconns;i++)
+        close(conns[i].fd);
+    close(lfd);
+    return(NULL);
+}
+
+/*
+ * Start serving statistics
+ * Args: Address: the path of a unix socket or [<address>:]<port> (default
+ * address 127.0.0.1)
+ * Returns: 0 on success, -1 on failure
+ * Should be called with the signals handled by the main thread blocked
+ */
+int init_stats(char *addr)
+{
+    struct sockaddr_un sun;
+    struct addrinfo hints,*ai,*aptr;
+    struct stat sb;
+    char *host,*port,*tptr;
+    pthread_t tid;
+    int fd=-1,on=1,err;
+
+    if (*addr == '/') {
+        if (strlen(addr) >= sizeof(sun.sun_path)) {
+            logerr(0,"Statistics socket name too long: %s",addr);
+            return(-1);
+        }
+        memset(&sun,0,sizeof(sun));
+        sun.sun_family=AF_UNIX;
+        strcpy(sun.sun_path,addr);
+        /* Remove any socket left by a previous run */
+        if (stat(addr,&sb) == 0 && S_ISSOCK(sb.st_mode))
+            (void) unlink(addr);
+        if ((fd=socket(AF_UNIX,SOCK_STREAM,0)) < 0 ||
+                bind(fd,(struct sockaddr *) &sun,sizeof(sun)) < 0) {
+            logerr(errno,"Could not create statistics socket %s",addr);
+            if (fd >= 0)
+                close(fd);
+            return(-1);
+        }
+    } else {
+        if ((host=strdup(addr)) == NULL)
+            return(-1);
+        if ((port=strrchr(host,':')) == NULL) {
+            port=host;
+            tptr="127.0.0.1";
+        } else {
+            *port++='\0';
+            tptr=host;
+            if (*tptr == '[' && tptr[strlen(tptr)-1] == ']') {
+                tptr[strlen(tptr)-1]='\0';
+                tptr++;
+            }
+        }
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family=AF_UNSPEC;
+        hints.ai_socktype=SOCK_STREAM;
+        hints.ai_flags=AI_PASSIVE|AI_NUMERICSERV;
+        if ((err=getaddrinfo(tptr,port,&hints,&ai))) {
+            logerr(0,"Bad statistics address %s: %s",addr,gai_strerror(err));
+            free(host);
+            return(-1);
+        }
+        free(host);
+        for (aptr=ai;aptr;aptr=aptr->ai_next) {
+            if ((fd=socket(aptr->ai_family,aptr->ai_socktype,
+                    aptr->ai_protocol)) < 0)
+                continue;
+            (void) setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+            if (bind(fd,aptr->ai_addr,aptr->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd=-1;
+        }
+        freeaddrinfo(ai);
+        if (fd < 0) {
+            logerr(errno,"Could not bind statistics server to %s",addr);
+            return(-1);
+        }
+    }
+
+    if (listen(fd,5) < 0 ||
+            pthread_create(&tid,NULL,serve_stats,(void *) (intptr_t) fd)) {
+        logerr(errno,"Could not start statistics server");
+        close(fd);
+        return(-1);
+    }
+    DEBUG(3,"Serving statistics on %s",addr);
+    return(0);
+}
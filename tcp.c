@@ -207,6 +207,7 @@ int reconnect(iface_t *ifa, int err)
     }
     DEBUG(3,"%s: Reconnected (write) interface",ifa->name);
     if (retval == 0) {
+        stat_add(ifa,reconnects,1);
         if (ifa->pair) {
                 iftp = (struct if_tcp *) ifa->pair->info;
                 iftp->fd = ift->fd;
@@ -274,8 +275,10 @@ ssize_t reread(iface_t *ifa, char *buf, int bsize)
                 DEBUG(7,"%s: Retrying connection...",ifa->name);
                 if ((nread=connect(ift->fd,
                         (const struct sockaddr *)&ift->shared->sa,
-                        ift->shared->sa_len)) == 0)
+                        ift->shared->sa_len)) == 0) {
                     DEBUG(3,"%s: Reconnected (read) interface",ifa->name);
+                    stat_add(ifa,reconnects,1);
+                }
 
             }
         } else {
@@ -311,6 +314,38 @@ ssize_t reread(iface_t *ifa, char *buf, int bsize)
     return(nread);
 }
 
+/*
+ * Read from a tcp connection noting the kernel's receive time
+ * Args: Interface pointer, tcp information and buffer (BUFSIZ bytes)
+ * Returns: As read()
+ * Side effects: the interface's rxstamp is updated
+ */
+static ssize_t read_stamped(iface_t *ifa, struct if_tcp *ift, char *buf)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    char ctl[CMSG_SPACE(sizeof(struct timespec))];
+    int64_t off=0;
+    ssize_t nread;
+
+    /* Connections are re-established on a new socket */
+    if (ift->stampfd != ift->fd) {
+        rxstamp_on(ift->fd);
+        ift->stampfd=ift->fd;
+    }
+
+    memset(&mh,0,sizeof(mh));
+    iov.iov_base=buf;
+    iov.iov_len=BUFSIZ;
+    mh.msg_iov=&iov;
+    mh.msg_iovlen=1;
+    mh.msg_control=ctl;
+    mh.msg_controllen=sizeof(ctl);
+    if ((nread=recvmsg(ift->fd,&mh,0)) > 0)
+        ifa->rxstamp=rxstamp(&mh,&off);
+    return(nread);
+}
+
 ssize_t read_tcp(struct iface *ifa, char *buf)
 {
     struct if_tcp *ift = (struct if_tcp *) ifa->info;
@@ -351,7 +386,10 @@ ssize_t read_tcp(struct iface *ifa, char *buf)
          * to a process reading from socket which times out due to unreplied to
          * keepalives.  Instead the read exits with ETIMEDOUT
          */
-        nread=read(ift->fd,buf,BUFSIZ);
+        if (ifa->stats)
+            nread=read_stamped(ifa,ift,buf);
+        else
+            nread=read(ift->fd,buf,BUFSIZ);
         if (nread <= 0) {
             if (nread) {
                 DEBUG(3,"%s: %s",ifa->name,"Read Failed");
@@ -397,49 +435,35 @@ ssize_t read_tcp(struct iface *ifa, char *buf)
 void write_tcp(struct iface *ifa)
 {
     struct if_tcp *ift = (struct if_tcp *) ifa->info;
-    senblk_t *sptr;
+    senblk_t *vec[BATCHMAX];
+    struct iovec iov[BATCHIOV];
+    size_t n;
+    int stride;
     int status=0;
     int err=0;
-    int data=0;
-    int cnt=1;
     int done = 0;
-    struct iovec iov[2];
+    char *tbuf=NULL;
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*BATCHMAX)) == NULL) {
                 logerr(errno,"Disabing tag output on interface id %x (%s)",
                         ifa->id,ifa->name);
                 ifa->tagflags=0;
-        } else {
-            cnt=2;
-            data=1;
         }
     }
 
     for(;(!done);) {
 
-        if ((sptr = next_senblk(ifa->q)) == NULL)
+        if ((n = next_senblk_batch(ifa->q,vec,BATCHMAX)) == 0)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
+        stride=senblk_iov(ifa,vec,&n,iov,tbuf,0);
+        if (n == 0)
             continue;
-        }
 
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
-                logerr(errno,"Disabing tag output on interface id %x (%s)",
-                        ifa->id,ifa->name);
-                ifa->tagflags=0;
-                cnt=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
         /* SIGPIPE is blocked here so we can avoid using the (non-portable)
          * MSG_NOSIGNAL
          */
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
         if (flag_test(ifa,F_PERSIST)) {
             pthread_mutex_lock(&ift->shared->t_mutex);
             if (ift->fd == -1)
@@ -448,15 +472,15 @@ void write_tcp(struct iface *ifa)
                 ift->shared->critical++;
             pthread_mutex_unlock(&ift->shared->t_mutex);
             if (done) {
-                senblk_free(sptr,ifa->q);
+                senblk_free_batch(vec,n,ifa->q);
                 break;
             }
         }
-        if (writev(ift->fd,iov,cnt) <0) {
+        if (writev_all(ift->fd,iov,n*stride) <0) {
             DEBUG2(3,"%s id %x: write failed",ifa->name,ifa->id);
             err=errno;
             if (!flag_test(ifa,F_PERSIST)) {
-                senblk_free(sptr,ifa->q);
+                senblk_free_batch(vec,n,ifa->q);
                 break;
             }
             pthread_mutex_lock(&ift->shared->t_mutex);
@@ -489,11 +513,11 @@ void write_tcp(struct iface *ifa)
                 pthread_cond_signal(&ift->shared->fv);
             pthread_mutex_unlock(&ift->shared->t_mutex);
         }
-        senblk_free(sptr,ifa->q);
+        senblk_free_batch(vec,n,ifa->q);
     }
 
-    if (cnt == 2)
-        free(iov[0].iov_base);
+    if (tbuf)
+        free(tbuf);
 
     iface_thread_exit(errno);
 }
@@ -568,28 +592,61 @@ void delayed_connect(iface_t *ifa)
     }
 }
 
+/*
+ * Free a connection which couldn't be started
+ * Args: connection, not yet on the interface lists
+ * Returns: Nothing
+ * Side effects: Any pair is freed too.  The socket is left for the caller
+ * to close
+ */
+static void free_tcp_conn(iface_t *ifa)
+{
+    iface_t *pair=ifa->pair;
+    int i;
+
+    /* An input's queue is only set when it is the last thing to succeed */
+    if (ifa->direction != IN && ifa->q)
+        free_q(ifa->q);
+    free_filter(ifa->ifilter);
+    free_filter(ifa->ofilter);
+    for (i=0;i<MAXPRIO;i++)
+        free_filter(ifa->priority[i]);
+    free_dedup(ifa);
+    if (ifa->info)
+        free(ifa->info);
+    free(ifa);
+
+    if (pair) {
+        pair->pair=NULL;
+        free_tcp_conn(pair);
+    }
+}
+
 iface_t *new_tcp_conn(int fd, iface_t *ifa)
 {
     iface_t *newifa;
     struct if_tcp *oldift=(struct if_tcp *) ifa->info;
     struct if_tcp *newift=NULL;
     pthread_t tid;
-    int on=1;
+    int on=1,i;
     sigset_t set,saved;
 
     if ((newifa = malloc(sizeof(iface_t))) == NULL)
         return(NULL);
 
     memset(newifa,0,sizeof(iface_t));
+    /* init_q() looks at these */
+    newifa->type=TCP;
+    newifa->flags=ifa->flags;
+    for (i=0;i<MAXPRIO;i++)
+        newifa->priority[i]=addfilter(ifa->priority[i]);
 
     if (((newift = (struct if_tcp *) malloc(sizeof(struct if_tcp))) == NULL) ||
-            ((ifa->direction != IN) &&
-            (init_q(newifa, oldift->qsize) < 0))) {
-        if (newifa && newifa->q)
-            free(newifa->q);
-        if (newift)
-            free(newift);
-        free(newifa);
+            ((ifa->direction != IN) && ((ifa->q)?
+            (init_cursor_q(newifa, ifa->q) < 0):
+            (init_q(newifa, oldift->qsize) < 0)))) {
+        newifa->info=newift;
+        free_tcp_conn(newifa);
         return(NULL);
     }
     memset(newift,0,sizeof(struct if_tcp));
@@ -610,25 +667,55 @@ iface_t *new_tcp_conn(int fd, iface_t *ifa)
     newifa->lists=ifa->lists;
     newifa->ifilter=addfilter(ifa->ifilter);
     newifa->ofilter=addfilter(ifa->ofilter);
+    if (ifa->dedup && ifa->direction != IN &&
+            (newifa->dedup=new_dedup(ifa->dedup->window)) == NULL)
+        logerr(errno,"%s: No duplicate suppression for new connection",
+                ifa->name);
     newifa->checksum=ifa->checksum;
     newifa->strict=ifa->strict;
-    if (ifa->direction == IN)
-        newifa->q=ifa->lists->engine->q;
-    else {
+    newifa->stats=ifa->stats;
+    if (ifa->direction == IN) {
+        if (init_input_q(newifa,ifa->lists->engine->q) < 0) {
+            logwarn("Could not create queue for new connection");
+            free_tcp_conn(newifa);
+            return(NULL);
+        }
+    } else {
         if (setsockopt(fd,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(on)) < 0)
             logerr(errno,"Could not disable Nagle on new tcp connection");
 
         if (ifa->direction == BOTH) {
             if ((newifa->next=ifdup(newifa)) == NULL) {
                 logwarn("Interface duplication failed");
-                free(newifa->q);
-                free(newift);
-                free(newifa);
+                free_tcp_conn(newifa);
                 return(NULL);
             }
             newifa->direction=OUT;
             newifa->pair->direction=IN;
-            newifa->pair->q=ifa->lists->engine->q;
+            if (init_input_q(newifa->pair,ifa->lists->engine->q) < 0) {
+                logwarn("Could not create queue for new connection");
+                free_tcp_conn(newifa);
+                return(NULL);
+            }
+        }
+    }
+
+    if (ev_active()) {
+        /* The event loop owns the socket: don't let cleanup_tcp() close it */
+        newift->fd=-1;
+        if (newifa->pair)
+            ((struct if_tcp *) newifa->pair->info)->fd=-1;
+        if (ev_add_conn((newifa->direction == IN)?NULL:newifa,
+                (newifa->direction == IN)?newifa:newifa->pair,fd) == 0)
+            return(newifa);
+        logwarn("Failed to add connection to event loop");
+        newift->fd=fd;
+        if (newifa->pair)
+            ((struct if_tcp *) newifa->pair->info)->fd=fd;
+    }
+
+    if (ifa->direction != IN) {
+        if (ifa->direction == BOTH) {
             sigemptyset(&set);
             sigaddset(&set, SIGUSR1);
             pthread_sigmask(SIG_BLOCK, &set, &saved);
@@ -805,6 +892,9 @@ iface_t *init_tcp(iface_t *ifa)
     int nodelay=1;
     long timeout=-1;
     int gpsd=0;
+    int shared=0;
+    int qset=0;
+    enum lapped lapped=LAP_SKIP;
 
     host=port=NULL;
 
@@ -847,6 +937,27 @@ iface_t *init_tcp(iface_t *ifa)
                 logerr(0,"Invalid queue size specified: %s",opt->val);
                 return(NULL);
             }
+            qset=1;
+        } else if (!strcasecmp(opt->var,"shared")) {
+            if (!strcasecmp(opt->val,"yes"))
+                shared=1;
+            else if (!strcasecmp(opt->val,"no"))
+                shared=0;
+            else {
+                logerr(0,"shared must be \"yes\" or \"no\"");
+                return(NULL);
+            }
+        } else if (!strcasecmp(opt->var,"lapped")) {
+            if (!strcasecmp(opt->val,"skip"))
+                lapped=LAP_SKIP;
+            else if (!strcasecmp(opt->val,"disconnect"))
+                lapped=LAP_DISCONNECT;
+            else if (!strcasecmp(opt->val,"resync"))
+                lapped=LAP_RESYNC;
+            else {
+                logerr(0,"lapped must be \"skip\", \"disconnect\" or \"resync\"");
+                return(NULL);
+            }
         } else if (!strcasecmp(opt->var,"keepalive")) {
             if (!flag_test(ifa,F_PERSIST)) {
                 logerr(0,"keepalive valid only valid with persist option");
@@ -983,6 +1094,11 @@ iface_t *init_tcp(iface_t *ifa)
         }
     }
 
+    if (shared && (*conntype != 's' || ifa->direction == IN)) {
+        logerr(0,"shared option only valid for output or bi-directional servers");
+        return(NULL);
+    }
+
     if (!port) {
         if ((svent=getservbyname("nmea-0183","tcp")) != NULL)
             port=svent->s_name;
@@ -1131,6 +1247,12 @@ iface_t *init_tcp(iface_t *ifa)
     } else {
         ifa->write=tcp_server;
         ifa->read=tcp_server;
+        /* All clients read from the one ring the engine writes to */
+        if (shared && init_bcast_q(ifa,qset?ift->qsize:DEFSHAREDQSIZE,
+                lapped) < 0) {
+            logerr(errno,"Could not create shared queue");
+            return(NULL);
+        }
     }
     free_options(ifa->options);
     DEBUG(3,"%s: initialised",ifa->name);
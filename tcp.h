@@ -5,6 +5,7 @@
  */
 
 #define DEFTCPQSIZE 16
+#define DEFSHAREDQSIZE 256
 #define DEFSNDTIMEO 30
 #define DEFSNDBUF 1024
 #define DEFKEEPIDLE 30
@@ -19,6 +20,7 @@ struct tcp_preamble {
 
 struct if_tcp {
     int fd;
+    int stampfd;            /* fd receive timestamps were turned on for */
     size_t qsize;
     struct if_tcp_shared *shared;
 };
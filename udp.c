@@ -6,11 +6,18 @@
  * UDP interfaces
  */
 
+#ifdef __linux__
+/* for sendmmsg() */
+#define _GNU_SOURCE
+#endif
 #include "kplex.h"
 #include <netdb.h>
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
 
 #define DEFUDPQSIZE 64
 #define CBUFSIZ 128
@@ -40,6 +47,10 @@ struct if_udp {
     } mr;
     struct ignore_addr *ignore;
     struct coalesce *coalesce;
+    size_t rxbatch;
+    int rxwait;
+    long pack;
+    int maxhold;
 };
 
 /*
@@ -112,17 +123,14 @@ void cleanup_udp(iface_t *ifa)
     close(ifu->fd);
 }
 
-int is_ais(char *sptr,size_t len,size_t *nfrag, size_t *frag, unsigned int *seq)
+int is_ais(senblk_t *senp,size_t *nfrag, size_t *frag, unsigned int *seq)
 {
+    size_t len=senp->len;
+    char *sptr=senp->data+6;
     int i;
 
-    if (len < 13)
-        return(0);
-
-    if (!(sptr[3] == 'V' && sptr[4] == 'D' &&
-            (sptr[5] == 'M' || sptr[5] == 'O')))
+    if (senp->sclass != SC_AIS || len < 13)
         return(0);
-    sptr+=6;
 
     if ((*sptr++) != ',')
         return(0);
@@ -148,7 +156,7 @@ int is_ais(char *sptr,size_t len,size_t *nfrag, size_t *frag, unsigned int *seq)
     return(1);
 }
 
-int coalesce(struct if_udp *ifu, struct msghdr * mh)
+int coalesce(struct if_udp *ifu, struct msghdr * mh, senblk_t *sptr)
 {
     size_t nfrags,frag;
     unsigned int seqid;
@@ -158,8 +166,7 @@ int coalesce(struct if_udp *ifu, struct msghdr * mh)
     int i;
     struct coalesce *cp = ifu->coalesce;
 
-    if (!(is_ais(ioptr[data].iov_base,ioptr[data].iov_len,
-            &nfrags,&frag,&seqid)))
+    if (!(is_ais(sptr,&nfrags,&frag,&seqid)))
         return(0);
 
     if (nfrags == 1 && cp->offset == 0)
@@ -194,100 +201,511 @@ int coalesce(struct if_udp *ifu, struct msghdr * mh)
 }
 
 
-void write_udp(struct iface *ifa)
+/*
+ * Send a batch of datagrams
+ * Args: socket, array of message headers and number of messages
+ * Returns: 0 on success, -1 on error
+ * Uses a single sendmmsg() where it is available
+ */
+int send_batch(int fd, struct msghdr *msgs, int n)
 {
-    struct if_udp *ifu;
-    senblk_t *sptr;
-    int data=0;
-    struct msghdr msgh;
-    struct iovec iov[2];
+#ifdef __linux__
+    struct mmsghdr mmsgs[BATCHMAX];
+    int i,sent;
+
+    while (n) {
+        for (i=0;i<n && i<BATCHMAX;i++) {
+            mmsgs[i].msg_hdr=msgs[i];
+            mmsgs[i].msg_len=0;
+        }
+        if ((sent=sendmmsg(fd,mmsgs,i,0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return(-1);
+        }
+        msgs+=sent;
+        n-=sent;
+    }
+#else
+    for (;n;n--,msgs++)
+        if (sendmsg(fd,msgs,0) < 0)
+            return(-1);
+#endif
+    return(0);
+}
 
-    ifu = (struct if_udp *) ifa->info;
-    msgh.msg_name=(void *)&ifu->addr;
-    msgh.msg_namelen=ifu->asize;
-    msgh.msg_control=NULL;
-    msgh.msg_controllen=msgh.msg_flags=0;
-    msgh.msg_iov=iov;
-    msgh.msg_iovlen=1;
+/*
+ * Parse the options controlling batched datagram receipt
+ * Args: option, interface, pointers to batch size and wait time to be set
+ * Returns: 1 if the option was a batch option, 0 if not, -1 on error
+ */
+int parse_rxbatch(struct kopts *opt, iface_t *ifa, size_t *batch, int *wait)
+{
+    char *eptr;
+    long val;
+
+    if (strcasecmp(opt->var,"batch") && strcasecmp(opt->var,"batchwait"))
+        return(0);
+
+    if (ifa->direction == OUT) {
+        logerr(0,"%s option only valid for input or bi-directional interfaces",
+                opt->var);
+        return(-1);
+    }
+
+    val=strtol(opt->val,&eptr,0);
+    if (!strcasecmp(opt->var,"batch")) {
+        if (*eptr || val < 1 || val > BATCHMAX) {
+            logerr(0,"Invalid batch size %s: must be 1-%d",opt->val,BATCHMAX);
+            return(-1);
+        }
+        *batch=val;
+    } else {
+        if (*eptr || val < 0 || val > 1000) {
+            logerr(0,"Invalid batch wait %s: must be 0-1000 ms",opt->val);
+            return(-1);
+        }
+        *wait=val;
+    }
+    return(1);
+}
+
+/*
+ * Parse the options controlling packing of several sentences per datagram
+ * Args: option, interface, pointers to payload size and hold time to be set
+ * Returns: 1 if the option was a packing option, 0 if not, -1 on error
+ * Side effects: payload size is set to PACKMTU for "pack=yes", to be resolved
+ * by mtu_payload() once the destination is known
+ */
+int parse_pack(struct kopts *opt, iface_t *ifa, long *pack, int *maxhold)
+{
+    char *eptr;
+    long val;
+
+    if (strcasecmp(opt->var,"pack") && strcasecmp(opt->var,"maxhold"))
+        return(0);
+
+    if (ifa->direction == IN) {
+        logerr(0,"%s option only valid for output or bi-directional interfaces",
+                opt->var);
+        return(-1);
+    }
+
+    if (!strcasecmp(opt->var,"pack")) {
+        if (!strcasecmp(opt->val,"yes") || !strcasecmp(opt->val,"mtu"))
+            *pack=PACKMTU;
+        else if (!strcasecmp(opt->val,"no"))
+            *pack=0;
+        else if ((val=strtol(opt->val,&eptr,0)) < PACKMIN || val > PACKMAX ||
+                *eptr) {
+            logerr(0,"Invalid pack size %s: must be %d-%d, \"yes\" or \"no\"",
+                    opt->val,PACKMIN,PACKMAX);
+            return(-1);
+        } else
+            *pack=val;
+    } else {
+        if ((val=strtol(opt->val,&eptr,0)) < 0 || val > 10000 || *eptr) {
+            logerr(0,"Invalid maxhold %s: must be 0-10000 ms",opt->val);
+            return(-1);
+        }
+        *maxhold=val;
+    }
+    return(1);
+}
+
+/*
+ * Work out the largest datagram payload which can be sent unfragmented
+ * Args: address family of the destination and name of the system interface
+ * being sent from (NULL if unknown)
+ * Returns: payload size in bytes
+ * The MTU of the named interface is used if it can be found, otherwise that of
+ * ethernet.
+ */
+long mtu_payload(int family, char *ifname)
+{
+    struct ifreq ifr;
+    long mtu=1500;
+    int fd;
+
+    if (ifname && (fd=socket(AF_INET,SOCK_DGRAM,0)) >= 0) {
+        memset(&ifr,0,sizeof(ifr));
+        strncpy(ifr.ifr_name,ifname,IFNAMSIZ-1);
+        if (ioctl(fd,SIOCGIFMTU,&ifr) == 0)
+            mtu=ifr.ifr_mtu;
+        close(fd);
+    }
+
+    /* Subtract IP and UDP headers */
+    mtu-=(family == AF_INET6)?48:28;
+    if (mtu > PACKMAX)
+        mtu=PACKMAX;
+    else if (mtu < PACKMIN)
+        mtu=PACKMIN;
+    return(mtu);
+}
+
+/*
+ * Allocate an array of datagram structures with buffers
+ * Args: number of datagrams
+ * Returns: pointer to array or NULL on failure
+ * Side effects: The buffers are allocated with the array and freed with it
+ */
+struct dgram *alloc_dgrams(size_t n)
+{
+    struct dgram *dg;
+    char *bufs;
+    size_t i;
+
+    if ((dg=(struct dgram *) malloc(n*(sizeof(struct dgram)+BUFSIZ))) == NULL)
+        return(NULL);
+
+    for (i=0,bufs=(char *)(dg+n);i<n;i++,bufs+=BUFSIZ)
+        dg[i].buf=bufs;
+    return(dg);
+}
+
+/*
+ * Receive whatever datagrams are available without waiting for more
+ * Args: socket, datagram array, size of array and whether to block until the
+ * first arrives
+ * Returns: Number of datagrams received or -1 on error
+ */
+static int recv_some(int fd, struct dgram *dg, size_t max, int block)
+{
+    struct iovec iov[BATCHMAX];
+    /* Receive timestamps, if they've been turned on.  See rxstamp() */
+    char ctl[BATCHMAX][CMSG_SPACE(sizeof(struct timespec))];
+    int64_t off=0;
+#ifdef __linux__
+    struct mmsghdr msgs[BATCHMAX];
+#else
+    struct msghdr mh;
+    int flags=block?0:MSG_DONTWAIT;
+#endif
+    int i,n;
+
+    if (max > BATCHMAX)
+        max=BATCHMAX;
+
+#ifdef __linux__
+    memset(msgs,0,max*sizeof(struct mmsghdr));
+    for (i=0;i<max;i++) {
+        iov[i].iov_base=dg[i].buf;
+        iov[i].iov_len=BUFSIZ;
+        msgs[i].msg_hdr.msg_name=&dg[i].src;
+        msgs[i].msg_hdr.msg_namelen=(socklen_t) sizeof(dg[i].src);
+        msgs[i].msg_hdr.msg_iov=&iov[i];
+        msgs[i].msg_hdr.msg_iovlen=1;
+        msgs[i].msg_hdr.msg_control=ctl[i];
+        msgs[i].msg_hdr.msg_controllen=sizeof(ctl[i]);
+    }
+
+    /* MSG_WAITFORONE: block for the first datagram but not the rest */
+    if ((n=recvmmsg(fd,msgs,max,block?MSG_WAITFORONE:MSG_DONTWAIT,NULL)) < 0)
+        return(-1);
+
+    for (i=0;i<n;i++) {
+        dg[i].len=msgs[i].msg_len;
+        dg[i].srclen=msgs[i].msg_hdr.msg_namelen;
+        dg[i].stamp=rxstamp(&msgs[i].msg_hdr,&off);
+    }
+#else
+    memset(&mh,0,sizeof(mh));
+    mh.msg_iovlen=1;
+    for (n=0;n<max;n++,flags=MSG_DONTWAIT) {
+        iov[0].iov_base=dg[n].buf;
+        iov[0].iov_len=BUFSIZ;
+        mh.msg_name=&dg[n].src;
+        mh.msg_namelen=(socklen_t) sizeof(dg[n].src);
+        mh.msg_iov=iov;
+        mh.msg_control=ctl[0];
+        mh.msg_controllen=sizeof(ctl[0]);
+        if ((i=recvmsg(fd,&mh,flags)) < 0) {
+            if (n)
+                break;
+            return(-1);
+        }
+        dg[n].len=i;
+        dg[n].srclen=mh.msg_namelen;
+        dg[n].stamp=rxstamp(&mh,&off);
+    }
+#endif
+    return(n);
+}
+
+/*
+ * Receive a batch of datagrams
+ * Args: socket, datagram array, size of array and number of milliseconds to
+ * wait after the first datagram arrives for the batch to fill
+ * Returns: Number of datagrams received or -1 on error
+ * Blocks until at least one datagram is available.  recvmmsg()'s own timeout
+ * is only checked as datagrams arrive so we poll() for the remainder instead.
+ */
+int recv_batch(int fd, struct dgram *dg, size_t max, int wait)
+{
+    struct pollfd pfd;
+    struct timespec now,end;
+    int n,r,ms;
+
+    if ((n=recv_some(fd,dg,max,1)) <= 0 || wait <= 0 || n >= max)
+        return(n);
+
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    end.tv_sec+=wait/1000;
+    if ((end.tv_nsec+=(wait%1000)*1000000) >= 1000000000) {
+        end.tv_sec++;
+        end.tv_nsec-=1000000000;
+    }
+
+    pfd.fd=fd;
+    pfd.events=POLLIN;
+    while (n < max) {
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        if ((ms=(end.tv_sec-now.tv_sec)*1000+
+                (end.tv_nsec-now.tv_nsec)/1000000) <= 0)
+            break;
+        if (poll(&pfd,1,ms) <= 0)
+            break;
+        if ((r=recv_some(fd,dg+n,max-n,0)) <= 0)
+            break;
+        n+=r;
+    }
+    return(n);
+}
+
+/*
+ * Write routine for datagram outputs packing as many whole sentences into each
+ * datagram as will fit
+ * Args: Interface, socket, destination address and its size, maximum payload
+ * size and longest time in milliseconds to hold a sentence waiting for more
+ * to fill its datagram
+ * Returns: Nothing (when the queue is shut down or a send fails)
+ * Full datagrams are sent as soon as the sentences on hand are processed.  A
+ * partially filled one is held until maxhold has passed since its first
+ * sentence arrived, or until the queue runs dry if maxhold is 0
+ */
+void write_packed(iface_t *ifa, int fd, void *dst, socklen_t dstlen,
+        size_t size, int maxhold)
+{
+    senblk_t *vec[BATCHMAX];
+    struct msghdr msgs[BATCHMAX];
+    struct iovec iov[BATCHIOV];
+    struct iovec piov[BATCHMAX];
+    struct timespec deadline,*dl=NULL;
+    char *bufs,*tbuf=NULL;
+    size_t i,len,n2,npkt=0;
+    int n,j,stride;
+
+    if ((bufs=malloc(BATCHMAX*size)) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        return;
+    }
+
+    memset(msgs,0,sizeof(msgs));
+    for (i=0;i<BATCHMAX;i++) {
+        piov[i].iov_base=bufs+i*size;
+        piov[i].iov_len=0;
+        msgs[i].msg_name=dst;
+        msgs[i].msg_namelen=dstlen;
+        msgs[i].msg_iov=&piov[i];
+        msgs[i].msg_iovlen=1;
+    }
 
     if (ifa->tagflags) {
-        if ((iov[0].iov_base=malloc(TAGMAX)) == NULL) {
+        if ((tbuf=malloc(TAGMAX*BATCHMAX)) == NULL) {
                 logerr(errno,"%s: Disabing tag output",ifa->name);
                 ifa->tagflags=0;
-        } else {
-            msgh.msg_iovlen=2;
-            data=1;
         }
     }
+
     for (;;) {
-        if ((sptr = next_senblk(ifa->q)) == NULL)
+        if ((n=timed_senblk_batch(ifa->q,vec,BATCHMAX,dl)) <= 0) {
+            /* Deadline passed or shutting down: send what we have */
+            if (piov[0].iov_len && send_batch(fd,msgs,1) < 0)
+                break;
+            piov[0].iov_len=0;
+            dl=NULL;
+            if (n < 0)
+                break;
+            continue;
+        }
+
+        n2=n;
+        stride=senblk_iov(ifa,vec,&n2,iov,tbuf,0);
+
+        for (i=0;i<n2;i++) {
+            for (j=0,len=0;j<stride;j++)
+                len+=iov[i*stride+j].iov_len;
+            if (piov[npkt].iov_len + len > size && ++npkt == BATCHMAX) {
+                if (send_batch(fd,msgs,npkt) < 0)
+                    break;
+                for (npkt=0;npkt<BATCHMAX;npkt++)
+                    piov[npkt].iov_len=0;
+                npkt=0;
+                dl=NULL;
+            }
+            if (piov[npkt].iov_len == 0 && (npkt || dl == NULL)) {
+                /* First sentence in a datagram which might be held */
+                clock_gettime(QCLOCK,&deadline);
+                deadline.tv_sec+=maxhold/1000;
+                if ((deadline.tv_nsec+=(maxhold%1000)*1000000) >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec-=1000000000;
+                }
+                dl=&deadline;
+            }
+            for (j=0;j<stride;j++) {
+                memcpy((char *) piov[npkt].iov_base+piov[npkt].iov_len,
+                        iov[i*stride+j].iov_base,iov[i*stride+j].iov_len);
+                piov[npkt].iov_len+=iov[i*stride+j].iov_len;
+            }
+        }
+
+        senblk_free_batch(vec,n2,ifa->q);
+        if (i < n2)
             break;
 
-        if (senfilter(sptr,ifa->ofilter)) {
-            senblk_free(sptr,ifa->q);
-            continue;
+        /* Send full datagrams now and carry the last one over */
+        if (npkt) {
+            if (send_batch(fd,msgs,npkt) < 0)
+                break;
+            memcpy(piov[0].iov_base,piov[npkt].iov_base,piov[npkt].iov_len);
+            piov[0].iov_len=piov[npkt].iov_len;
+            for (i=1;i<=npkt;i++)
+                piov[i].iov_len=0;
+            npkt=0;
         }
+    }
+
+    if (tbuf)
+        free(tbuf);
+    free(bufs);
+}
+
+void write_udp(struct iface *ifa)
+{
+    struct if_udp *ifu;
+    senblk_t *vec[BATCHMAX];
+    struct msghdr msgs[BATCHMAX];
+    struct iovec iov[BATCHIOV];
+    size_t n,i,nfrags,frag;
+    unsigned int seqid;
+    int stride,pending;
+    char *tbuf=NULL;
+
+    ifu = (struct if_udp *) ifa->info;
+
+    if (ifu->pack) {
+        write_packed(ifa,ifu->fd,&ifu->addr,ifu->asize,ifu->pack,ifu->maxhold);
+        iface_thread_exit(errno);
+    }
 
-        if (ifa->tagflags)
-            if ((iov[0].iov_len = gettag(ifa,iov[0].iov_base,sptr)) == 0) {
+    memset(msgs,0,sizeof(msgs));
+    for (i=0;i<BATCHMAX;i++) {
+        msgs[i].msg_name=(void *)&ifu->addr;
+        msgs[i].msg_namelen=ifu->asize;
+    }
+
+    if (ifa->tagflags) {
+        if ((tbuf=malloc(TAGMAX*BATCHMAX)) == NULL) {
                 logerr(errno,"%s: Disabing tag output",ifa->name);
                 ifa->tagflags=0;
-                msgh.msg_iovlen=1;
-                data=0;
-                free(iov[0].iov_base);
-            }
+        }
+    }
+    for (;;) {
+        if ((n = next_senblk_batch(ifa->q,vec,BATCHMAX)) == 0)
+            break;
 
-        iov[data].iov_base=sptr->data;
-        iov[data].iov_len=sptr->len;
+        stride=senblk_iov(ifa,vec,&n,iov,tbuf,0);
 
-        if (ifu->coalesce) {
-            if (coalesce(ifu,&msgh)) {
-                senblk_free(sptr,ifa->q);
-                continue;
+        for (i=pending=0;i<n;i++) {
+            msgs[pending].msg_iov=iov+i*stride;
+            msgs[pending].msg_iovlen=stride;
+
+            if (ifu->coalesce) {
+                /* coalesce() may send: keep sentences in order */
+                if (pending && is_ais(vec[i],&nfrags,&frag,&seqid)) {
+                    if (send_batch(ifu->fd,msgs,pending) < 0)
+                        break;
+                    msgs[0].msg_iov=msgs[pending].msg_iov;
+                    pending=0;
+                }
+                if (coalesce(ifu,&msgs[pending],vec[i]))
+                    continue;
             }
+            pending++;
         }
 
-        if (sendmsg(ifu->fd,&msgh,0) < 0)
+        if (i < n || (pending && send_batch(ifu->fd,msgs,pending) < 0)) {
+            senblk_free_batch(vec,n,ifa->q);
             break;
-        senblk_free(sptr,ifa->q);
+        }
+        senblk_free_batch(vec,n,ifa->q);
     }
 
-    if (ifa->tagflags)
-        free(iov[0].iov_base);
+    if (tbuf)
+        free(tbuf);
 
     iface_thread_exit(errno);
 }
 
+/*
+ * Check whether a datagram was sent by one of our own broadcast outputs
+ * Args: if_udp structure and datagram
+ * Returns: 1 if the datagram should be ignored, 0 otherwise
+ */
+static int udp_ignored(struct if_udp *ifu, struct dgram *dg)
+{
+    /* Broadcast Interface: IPv4 */
+    if (ifu->ignore && ifu->ignore->writers &&
+            memcmp((void *)&dg->src,(void *)&ifu->ignore->iaddr,
+            (size_t) dg->srclen) == 0)
+        return(1);
+    return(0);
+}
+
 ssize_t read_udp(iface_t *ifa, char *buf)
 {
     struct if_udp *ifu = (struct if_udp *) ifa->info;
-    struct sockaddr_storage src;
-    ssize_t nread;
-    struct iovec iov;
-    struct msghdr mh;
+    struct dgram dg;
 
-    iov.iov_base = buf;
-    iov.iov_len = BUFSIZ;
+    dg.buf=buf;
+    do {
+        if (recv_some(ifu->fd,&dg,1,1) < 0)
+            return(-1);
+    } while (udp_ignored(ifu,&dg));
+    ifa->rxstamp=dg.stamp;
+    return(dg.len);
+}
 
-    mh.msg_name = &src;
-    mh.msg_namelen = (socklen_t) sizeof(src);
-    mh.msg_iov = &iov;
-    mh.msg_iovlen = 1;
-    mh.msg_control = NULL;
-    mh.msg_controllen = 0;
-    mh.msg_flags = 0;
+/*
+ * Read routine for udp interfaces, receiving several datagrams per call
+ * Args: Interface Pointer
+ * Returns: nothing
+ */
+void read_udp_batch(iface_t *ifa)
+{
+    struct if_udp *ifu = (struct if_udp *) ifa->info;
+    struct rdstate rs;
+    struct dgram *dg;
+    int i,n;
 
-    do {
-        nread = recvmsg(ifu->fd,&mh,0);
+    if ((dg=alloc_dgrams(ifu->rxbatch)) == NULL) {
+        logerr(errno,"Could not allocate memory");
+        iface_thread_exit(errno);
+    }
 
-        if (ifu->ignore && ifu->ignore->writers) {
-        /* Broadcast Interface: IPv4 */
-            if (memcmp((void *)&src,(void *)&ifu->ignore->iaddr,(size_t) mh.msg_namelen)
-                    == 0) 
-                continue;
-        }
-        return (nread);
-    } while(1);
+    init_rdstate(ifa,&rs);
+
+    while ((n=recv_batch(ifu->fd,dg,ifu->rxbatch,ifu->rxwait)) > 0)
+        for (i=0;i<n;i++)
+            if (!udp_ignored(ifu,&dg[i])) {
+                rs.stamp=dg[i].stamp;
+                parse_buf(ifa,&rs,dg[i].buf,dg[i].len);
+            }
+
+    free(dg);
+    iface_thread_exit(errno);
 }
 
 /* Check whether an address is multicast
@@ -350,11 +768,18 @@ struct iface *init_udp(struct iface *ifa)
 
     memset(ifu,0,sizeof(struct if_udp));
     memset(&laddr,0,sizeof(struct sockaddr_storage));
+    ifu->rxbatch=DEFRXBATCH;
     sa=(struct sockaddr *)&ifu->addr;
 
     ifname=address=service=NULL;
 
     for(opt=ifa->options;opt;opt=opt->next) {
+        if ((err=parse_rxbatch(opt,ifa,&ifu->rxbatch,&ifu->rxwait)) < 0 ||
+                (err == 0 &&
+                (err=parse_pack(opt,ifa,&ifu->pack,&ifu->maxhold)) < 0))
+            return(NULL);
+        else if (err)
+            continue;
         if (!strcasecmp(opt->var,"device"))
             ifname=opt->val;
         else if (!strcasecmp(opt->var,"address") ||
@@ -391,6 +816,11 @@ struct iface *init_udp(struct iface *ifa)
         }
     }
 
+    if (coalesce && ifu->pack) {
+        logerr(0,"coalesce and pack options are mutually exclusive");
+        return(NULL);
+    }
+
     if (!service) {
         if ((svent = getservbyname("nmea-0183","udp")) != NULL) {
             service=svent->s_name;
@@ -742,6 +1172,8 @@ struct iface *init_udp(struct iface *ifa)
             logerr(errno,"Could not create queue");
             return(NULL);
         }
+        if (ifu->pack == PACKMTU)
+            ifu->pack=mtu_payload(ifu->addr.ss_family,ifname);
         if (coalesce) {
             if ((ifu->coalesce=
                     (struct coalesce *)malloc(sizeof(struct coalesce))) == NULL) {
@@ -782,8 +1214,11 @@ struct iface *init_udp(struct iface *ifa)
             ((struct sockaddr_in6*)&ifu->addr)->sin6_port));
     }
 
+    if (ifa->stats && ifa->direction != OUT)
+        rxstamp_on(ifu->fd);
+
     ifa->write=write_udp;
-    ifa->read=do_read;
+    ifa->read=(ifu->rxbatch > 1)?read_udp_batch:do_read;
     ifa->readbuf=read_udp;
     ifa->cleanup=cleanup_udp;
     ifa->info = (void *) ifu;